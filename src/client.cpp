@@ -5,12 +5,19 @@
 #include <atomic>
 #include <string>
 #include <mutex>
+#include <map>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdio>
 
 #ifdef WINDOWS_BUILD
     #include <winsock2.h>
     #include <ws2tcpip.h>
     #include <windows.h>
     #include <conio.h>
+    #include <direct.h>
     #pragma comment(lib, "ws2_32.lib")
     typedef int socklen_t;
     #define close closesocket
@@ -22,6 +29,7 @@
     #include <termios.h>
     #include <sys/ioctl.h>
     #include <signal.h>
+    #include <sys/stat.h>
     typedef int SOCKET;
     #define INVALID_SOCKET -1
 #endif
@@ -35,6 +43,9 @@ string username;
 mutex displayMutex;
 int messageRow = 4;
 
+const char* const SERVER_IP = "127.0.0.1";
+const int SERVER_PORT = 8080;
+
 // Terminal control functions
 void clearScreen() {
 #ifdef WINDOWS_BUILD
@@ -198,6 +209,258 @@ void displayMessage(const string& msg) {
     cout.flush();
 }
 
+// File transfers run on their own connections so chat never waits behind
+// file data. See the protocol notes in server.cpp.
+const uint32_t TRANSFER_CHUNK_SIZE = 64 * 1024;
+const int TRANSFER_RETRIES = 5;
+const string DOWNLOAD_DIR = "downloads";
+
+map<string, string> pendingUploads;   // file name -> local path
+mutex uploadsMutex;
+
+SOCKET connectToServer() {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, SERVER_IP, &serverAddress.sin_addr);
+    if (connect(s, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        close(s);
+        return INVALID_SOCKET;
+    }
+#ifdef SO_PRIORITY
+    // Bulk traffic: let the kernel send chat packets first
+    int priority = 1;
+    setsockopt(s, SOL_SOCKET, SO_PRIORITY, (char*)&priority, sizeof(priority));
+#endif
+    return s;
+}
+
+bool sendAll(SOCKET s, const char* data, size_t length) {
+    while (length > 0) {
+        int n = send(s, data, (int)length, 0);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool recvAll(SOCKET s, char* data, size_t length) {
+    while (length > 0) {
+        int n = recv(s, data, (int)length, 0);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Reads up to the server's "READY <offset>" line, skipping the greeting
+bool readReady(SOCKET s, unsigned long long& offset) {
+    string line;
+    char c;
+    while (line.size() < 4096 && recvAll(s, &c, 1)) {
+        if (c == '\n') {
+            size_t ready = line.find("READY ");
+            return ready != string::npos && sscanf(line.c_str() + ready, "READY %llu", &offset) == 1;
+        }
+        line += c;
+    }
+    return false;
+}
+
+string formatThroughput(uint64_t bytes, chrono::steady_clock::time_point started) {
+    double seconds = max(chrono::duration<double>(chrono::steady_clock::now() - started).count(), 1e-6);
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%llu bytes in %.2f s (%.2f MB/s)",
+             (unsigned long long)bytes, seconds, bytes / seconds / (1024 * 1024));
+    return buf;
+}
+
+// "/send <target> <path>": announce the file; the upload starts when the
+// server answers with "[FILE] upload ..."
+void requestSend(const string& input) {
+    stringstream ss(input.substr(6));
+    string target, path;
+    ss >> target;
+    getline(ss >> ws, path);
+    ifstream file(path.c_str(), ios::binary | ios::ate);
+    if (target.empty() || !file) {
+        displayMessage("[ERROR] Usage: /send user|room file (file must exist)");
+        return;
+    }
+    string name = path.substr(path.find_last_of("/\\") + 1);
+    for (auto& c : name) {
+        if (c == ' ') c = '_';
+    }
+    {
+        lock_guard<mutex> lock(uploadsMutex);
+        pendingUploads[name] = path;
+    }
+    string command = "/send " + target + " " + name + " " + to_string((long long)file.tellg());
+    send(clientSocket, command.c_str(), (int)command.length(), 0);
+}
+
+void uploadFile(string id, string token, string path) {
+    for (int attempt = 0; attempt < TRANSFER_RETRIES; attempt++) {
+        if (attempt > 0) this_thread::sleep_for(chrono::seconds(1));
+        SOCKET s = connectToServer();
+        if (s == INVALID_SOCKET) continue;
+
+        // The server says how much it already has, so a retry resumes
+        string request = "/upload " + id + " " + token;
+        unsigned long long offset = 0;
+        bool ok = sendAll(s, request.c_str(), request.size()) && readReady(s, offset);
+        if (!ok) {
+            close(s);
+            continue;
+        }
+
+        ifstream file(path.c_str(), ios::binary);
+        file.seekg((streamoff)offset);
+        vector<char> chunk(sizeof(uint32_t) + TRANSFER_CHUNK_SIZE);
+        while (ok && file) {
+            file.read(&chunk[sizeof(uint32_t)], TRANSFER_CHUNK_SIZE);
+            uint32_t length = (uint32_t)file.gcount();
+            if (length == 0) break;
+            uint32_t header = htonl(length);
+            memcpy(&chunk[0], &header, sizeof(header));
+            ok = sendAll(s, &chunk[0], sizeof(header) + length);
+        }
+        uint32_t end = 0;
+        ok = ok && sendAll(s, (const char*)&end, sizeof(end));
+        close(s);
+        if (ok) return;   // the server reports completion over the chat connection
+    }
+    displayMessage("[ERROR] Upload of " + path + " failed; /send it again to resume");
+}
+
+void downloadFile(string id, string token, string name, uint64_t size) {
+#ifdef WINDOWS_BUILD
+    _mkdir(DOWNLOAD_DIR.c_str());
+#else
+    mkdir(DOWNLOAD_DIR.c_str(), 0755);
+#endif
+    string path = DOWNLOAD_DIR + "/" + name;
+    string partPath = path + ".part";
+    auto started = chrono::steady_clock::now();
+
+    for (int attempt = 0; attempt < TRANSFER_RETRIES; attempt++) {
+        if (attempt > 0) this_thread::sleep_for(chrono::seconds(1));
+        // Resume from whatever an earlier attempt already wrote
+        uint64_t offset = 0;
+        {
+            ifstream part(partPath.c_str(), ios::binary | ios::ate);
+            if (part) offset = (uint64_t)part.tellg();
+        }
+        SOCKET s = connectToServer();
+        if (s == INVALID_SOCKET) continue;
+
+        string request = "/download " + id + " " + token + " " + to_string((unsigned long long)offset);
+        unsigned long long start = 0;
+        bool ok = sendAll(s, request.c_str(), request.size()) && readReady(s, start) && start == offset;
+        bool finished = false;
+        {
+            ofstream out(partPath.c_str(), ios::binary | ios::app);
+            vector<char> chunk(TRANSFER_CHUNK_SIZE);
+            while (ok && !finished) {
+                uint32_t length = 0;
+                ok = recvAll(s, (char*)&length, sizeof(length));
+                length = ntohl(length);
+                if (!ok || length > TRANSFER_CHUNK_SIZE) break;
+                finished = length == 0;
+                ok = recvAll(s, &chunk[0], length) && out.write(&chunk[0], length);
+            }
+        }
+        close(s);
+        if (finished && ok) {
+            remove(path.c_str());
+            rename(partPath.c_str(), path.c_str());
+            displayMessage("[FILE] Saved " + path + ": " + formatThroughput(size - offset, started));
+            return;
+        }
+    }
+    displayMessage("[ERROR] Download of " + name + " failed; /fetch " + id + " again to resume");
+}
+
+// Starts transfers the server asked for; returns true for control messages
+// that shouldn't be shown
+bool handleFileMessage(const string& msg) {
+    stringstream ss(msg);
+    string tag, kind, id, token, name;
+    ss >> tag >> kind >> id >> token >> name;
+    if (tag != "[FILE]" || name.empty()) return false;
+
+    if (kind == "upload") {
+        string path;
+        {
+            lock_guard<mutex> lock(uploadsMutex);
+            auto it = pendingUploads.find(name);
+            if (it == pendingUploads.end()) return true;
+            path = it->second;
+        }
+        displayMessage("[FILE] Uploading " + name + "...");
+        thread(uploadFile, id, token, path).detach();
+        return true;
+    }
+    if (kind == "download") {
+        unsigned long long size = 0;
+        ss >> size;
+        displayMessage("[FILE] Downloading " + name + "...");
+        thread(downloadFile, id, token, name, (uint64_t)size).detach();
+        return true;
+    }
+    return false;
+}
+
+const string FILE_UPLOAD_PREFIX = "[FILE] upload ";
+const string FILE_DOWNLOAD_PREFIX = "[FILE] download ";
+
+// Whether `line` is, or could still become, a transfer control line
+bool isFileControl(const string& line, bool complete) {
+    for (const string* prefix : {&FILE_UPLOAD_PREFIX, &FILE_DOWNLOAD_PREFIX}) {
+        if (line.compare(0, prefix->size(), *prefix) == 0) return true;
+        if (!complete && !line.empty() && prefix->compare(0, line.size(), line) == 0) return true;
+    }
+    return false;
+}
+
+string fileControlCarry;   // control line split across two recv() calls
+
+// The server sends transfer control replies on lines of their own, but they
+// can share a recv() with chat text. Handles them and returns the rest.
+string takeFileMessages(const string& received) {
+    string data = fileControlCarry + received;
+    fileControlCarry.clear();
+    string rest;
+    bool handled = false;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t newline = data.find('\n', pos);
+        string line = data.substr(pos, newline == string::npos ? string::npos : newline - pos);
+        if (newline == string::npos && isFileControl(line, false)) {
+            fileControlCarry = line;
+            break;
+        }
+        if (isFileControl(line, true) && handleFileMessage(line)) {
+            handled = true;
+        } else {
+            rest += line;
+            if (newline != string::npos) rest += '\n';
+        }
+        pos = newline == string::npos ? data.size() : newline + 1;
+    }
+    if (handled) {
+        // Drop the line breaks that only separated the control lines
+        size_t end = rest.find_last_not_of('\n');
+        rest = end == string::npos ? "" : rest.substr(0, end + 1);
+    }
+    return rest;
+}
+
 void receiveMessages() {
     char buffer[4096];
     
@@ -213,7 +476,10 @@ void receiveMessages() {
             break;
         }
         
-        string msg(buffer);
+        string msg = takeFileMessages(string(buffer, bytesReceived));
+        if (msg.empty()) {
+            continue;
+        }
         
         // Check for successful login
         if (msg.find("[SUCCESS] Login successful") != string::npos) {
@@ -271,6 +537,8 @@ int main() {
     SetConsoleCtrlHandler(ConsoleHandler, TRUE);
 #else
     signal(SIGINT, signalHandler);
+    // A dropped file transfer connection must not kill the client
+    signal(SIGPIPE, SIG_IGN);
 #endif
     
     clearScreen();
@@ -305,8 +573,8 @@ int main() {
     sockaddr_in serverAddress;
     memset(&serverAddress, 0, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(8080);
-    if (inet_pton(AF_INET, "127.0.0.1", &serverAddress.sin_addr) <= 0) {
+    serverAddress.sin_port = htons(SERVER_PORT);
+    if (inet_pton(AF_INET, SERVER_IP, &serverAddress.sin_addr) <= 0) {
         perror("Invalid address");
         return 1;
     }    
@@ -402,7 +670,11 @@ int main() {
                 messageRow = 4;
                 drawUI();
             } else {
-                send(clientSocket, message.c_str(), (int)message.length(), 0);
+                if (message.compare(0, 6, "/send ") == 0) {
+                    requestSend(message);
+                } else {
+                    send(clientSocket, message.c_str(), (int)message.length(), 0);
+                }
                 
                 // Clear the input line after sending
                 lock_guard<mutex> lock(displayMutex);
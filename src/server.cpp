@@ -16,18 +16,41 @@
 #include <sstream>
 #include <fstream>
 #include <functional>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include <cctype>
+#include <random>
+#include <iomanip>
 
 #ifdef WINDOWS_BUILD
     #include <winsock2.h>
     #include <ws2tcpip.h>
+    #include <io.h>
+    #include <direct.h>
+    #include <fcntl.h>
     #pragma comment(lib, "ws2_32.lib")
     typedef int socklen_t;
+    #define ftruncate _chsize_s
     // Don't #define close to closesocket -- that breaks std::ifstream::close() etc.
 #else
     #include <netinet/in.h>
     #include <sys/socket.h>
     #include <unistd.h>
     #include <arpa/inet.h>
+    #include <netdb.h>
+    #include <signal.h>
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <cerrno>
+    #include <sys/un.h>
+    #include <sys/stat.h>
+    #ifdef __linux__
+        #include <sys/sendfile.h>
+    #endif
     typedef int SOCKET;
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
@@ -55,6 +78,59 @@ map<string, vector<string>> messageHistory;
 mutex historyMutex;
 
 const string USERS_FILE = "users.dat";
+const string DEFAULT_ROOM = "global";
+const size_t HISTORY_LIMIT = 100;
+
+// Per-connection state that survives a hot upgrade
+struct SessionState {
+    string ipAddress;
+    string username;    // empty until the client has logged in
+    string room;
+    uint64_t lastSeq;   // sequence number of the last message the client posted
+};
+
+atomic<uint64_t> messageSeq(0);
+
+enum FloodPenalty { PENALTY_DELAY, PENALTY_DROP, PENALTY_DISCONNECT };
+
+// Command line configurable settings
+struct ServerConfig {
+    int port;
+    string nodeId;
+    int clusterPort;              // 0 disables clustering
+    string clusterBind;           // address the cluster port listens on
+    string clusterSecret;         // shared by all nodes, checked at HELLO
+    vector<string> peers;         // host:port of the other nodes' cluster ports
+    string upgradeSocket;         // Unix socket used to hand over to a new binary
+    vector<string> admins;        // users allowed to run admin commands
+
+    // Flood control; rates are per second, 0 disables a limit
+    double sessionMessageRate;
+    double sessionByteRate;
+    double ipMessageRate;
+    double ipByteRate;
+    double authRate;              // /login and /register attempts per IP
+    FloodPenalty floodPenalty;
+
+    size_t searchMaxDocs;         // messages kept in the search index
+    string spoolDir;              // uploaded files
+    uint64_t spoolMaxBytes;       // total size of files kept in the spool
+
+    uint32_t traceSampleEvery;    // trace one in N chat messages, 0 disables
+    string traceDumpFile;         // latency report rewritten periodically
+
+    ServerConfig()
+        : port(8080), clusterPort(0), clusterBind("127.0.0.1"),
+          sessionMessageRate(10), sessionByteRate(32 * 1024),
+          ipMessageRate(40), ipByteRate(128 * 1024),
+          authRate(0.2), floodPenalty(PENALTY_DROP),
+          searchMaxDocs(1000000), spoolDir("spool"), spoolMaxBytes(1024ULL * 1024 * 1024),
+          traceSampleEvery(100) {}
+};
+
+ServerConfig config;
+SOCKET clientListener = INVALID_SOCKET;
+SOCKET clusterListener = INVALID_SOCKET;
 
 #ifdef WINDOWS_BUILD
 bool initWinsock() {
@@ -81,6 +157,15 @@ inline void closeSocket(SOCKET s) {
 #endif
 }
 
+// Wakes any thread blocked reading or writing `s` before it is closed
+inline void shutdownSocket(SOCKET s) {
+#ifdef WINDOWS_BUILD
+    shutdown(s, SD_BOTH);
+#else
+    shutdown(s, SHUT_RDWR);
+#endif
+}
+
 // Simple hash function (use a proper library like bcrypt in production)
 string hashPassword(const string& password) {
     hash<string> hasher;
@@ -128,15 +213,6 @@ bool verifyPassword(const string& username, const string& password) {
     return users[username].passwordHash == hashPassword(password);
 }
 
-void broadcastMessage(const string& message, SOCKET senderSocket) {
-    lock_guard<mutex> lock(clientsMutex);
-    for (const auto& client : clients) {
-        if (client.socket != senderSocket && client.authenticated) {
-            send(client.socket, message.c_str(), (int)message.length(), 0);
-        }
-    }
-}
-
 void sendToClient(SOCKET socket, const string& message) {
     send(socket, message.c_str(), (int)message.length(), 0);
 }
@@ -148,231 +224,3068 @@ string getCurrentTime() {
     return string(buf);
 }
 
-void handleClient(SOCKET clientSocket, sockaddr_in clientAddr) {
-    char buffer[4096];
-    string username;
-    string ipAddr = inet_ntoa(clientAddr.sin_addr);
-    bool authenticated = false;
-    
-    // Send authentication prompt
-    sendToClient(clientSocket, "[SYSTEM] Welcome! Commands: /login username password OR /register username password");
-    
-    // Authentication loop
-    while (!authenticated) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesReceived <= 0) {
-            closeSocket(clientSocket);
-            return;
-        }
-        
-        string command(buffer);
-        stringstream ss(command);
-        string action, user, pass;
-        ss >> action >> user >> pass;
-        
-        if (action == "/register") {
-            if (user.empty() || pass.empty()) {
-                sendToClient(clientSocket, "[ERROR] Usage: /register username password");
-                continue;
-            }
-            
-            if (userExists(user)) {
-                sendToClient(clientSocket, "[ERROR] Username already exists!");
-                continue;
-            }
-            
-            string hashedPass = hashPassword(pass);
-            users[user] = {user, hashedPass};
-            saveUser(user, hashedPass);
-            sendToClient(clientSocket, "[SUCCESS] Registration successful! Now use /login username password");
-            cout << "[+] New user registered: " << user << endl;
-            
-        } else if (action == "/login") {
-            if (user.empty() || pass.empty()) {
-                sendToClient(clientSocket, "[ERROR] Usage: /login username password");
-                continue;
-            }
-            
-            if (!userExists(user)) {
-                sendToClient(clientSocket, "[ERROR] Username not found! Use /register first.");
-                continue;
-            }
-            
-            if (!verifyPassword(user, pass)) {
-                sendToClient(clientSocket, "[ERROR] Invalid password!");
-                continue;
+// ---------------------------------------------------------------------------
+// Latency tracing
+//
+// One in --trace-sample chat messages is timestamped with a monotonic clock
+// as flood control admits it (so a delay penalty isn't counted), parsed,
+// persisted, queued for broadcast and flushed to each recipient. The
+// intervals go into log2 microsecond histograms in a buffer owned by the
+// handling thread, so recording never contends; /stats and the --trace-dump
+// file sum the live buffers with those of finished threads.
+// ---------------------------------------------------------------------------
+
+enum TraceSpan {
+    SPAN_READ_PARSE,
+    SPAN_PARSE_PERSIST,
+    SPAN_PERSIST_QUEUE,
+    SPAN_QUEUE_FLUSH,
+    SPAN_END_TO_END,
+    TRACE_SPANS
+};
+
+const char* const TRACE_SPAN_NAMES[TRACE_SPANS] = {
+    "read -> parsed", "parsed -> persisted", "persisted -> queued",
+    "queued -> flushed", "read -> flushed"
+};
+const int TRACE_BUCKETS = 24;            // bucket b counts spans < 2^b us
+const int TRACE_DUMP_SECONDS = 10;
+
+typedef chrono::steady_clock::time_point TracePoint;
+
+struct MessageTrace {
+    bool sampled;
+    TracePoint read, parsed, persisted, queued;
+};
+
+struct TraceBuffer {
+    atomic<uint64_t> counts[TRACE_SPANS][TRACE_BUCKETS];
+
+    TraceBuffer() {
+        for (auto& span : counts)
+            for (auto& count : span) count.store(0, memory_order_relaxed);
+    }
+};
+
+vector<TraceBuffer*> traceBuffers;
+uint64_t retiredTraceCounts[TRACE_SPANS][TRACE_BUCKETS];
+mutex traceRegistryMutex;
+
+// Registers the thread's buffer on first use and folds it into the retired
+// totals when the thread exits
+struct TraceBufferHolder {
+    TraceBuffer* buffer;
+
+    TraceBufferHolder() : buffer(nullptr) {}
+    ~TraceBufferHolder() {
+        if (!buffer) return;
+        lock_guard<mutex> lock(traceRegistryMutex);
+        for (int s = 0; s < TRACE_SPANS; s++)
+            for (int b = 0; b < TRACE_BUCKETS; b++)
+                retiredTraceCounts[s][b] += buffer->counts[s][b].load(memory_order_relaxed);
+        traceBuffers.erase(find(traceBuffers.begin(), traceBuffers.end(), buffer));
+        delete buffer;
+    }
+};
+
+thread_local TraceBufferHolder traceHolder;
+thread_local uint32_t traceCountdown = 0;
+thread_local bool traceCountdownSeeded = false;
+
+TraceBuffer& localTraceBuffer() {
+    if (!traceHolder.buffer) {
+        traceHolder.buffer = new TraceBuffer();
+        lock_guard<mutex> lock(traceRegistryMutex);
+        traceBuffers.push_back(traceHolder.buffer);
+    }
+    return *traceHolder.buffer;
+}
+
+// Decides whether this message is sampled and stamps its read time
+void startTrace(MessageTrace& trace) {
+    trace.sampled = false;
+    if (config.traceSampleEvery == 0) return;
+    if (!traceCountdownSeeded) {
+        // A random phase per thread, so short sessions aren't all sampled on
+        // their first message
+        static mt19937 generator(random_device{}());
+        static mutex generatorMutex;
+        lock_guard<mutex> lock(generatorMutex);
+        traceCountdown = generator() % config.traceSampleEvery;
+        traceCountdownSeeded = true;
+    }
+    if (traceCountdown > 0) {
+        traceCountdown--;
+        return;
+    }
+    traceCountdown = config.traceSampleEvery - 1;
+    trace.sampled = true;
+    trace.read = chrono::steady_clock::now();
+}
+
+void recordSpan(TraceSpan span, TracePoint from, TracePoint to) {
+    uint64_t micros = (uint64_t)chrono::duration_cast<chrono::microseconds>(to - from).count();
+    int bucket = 0;
+    while (bucket < TRACE_BUCKETS - 1 && (micros >> bucket) != 0) bucket++;
+    // Only the owning thread writes, so a plain load/store avoids a locked add
+    atomic<uint64_t>& count = localTraceBuffer().counts[span][bucket];
+    count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// Every line starts with `prefix`
+string buildLatencyReport(const string& prefix) {
+    uint64_t totals[TRACE_SPANS][TRACE_BUCKETS];
+    {
+        lock_guard<mutex> lock(traceRegistryMutex);
+        memcpy(totals, retiredTraceCounts, sizeof(totals));
+        for (const TraceBuffer* buffer : traceBuffers)
+            for (int s = 0; s < TRACE_SPANS; s++)
+                for (int b = 0; b < TRACE_BUCKETS; b++)
+                    totals[s][b] += buffer->counts[s][b].load(memory_order_relaxed);
+    }
+
+    stringstream ss;
+    ss << prefix << "Latency (1 in " << config.traceSampleEvery
+       << " messages sampled, percentiles are bucket upper bounds in us)\n";
+    for (int s = 0; s < TRACE_SPANS; s++) {
+        uint64_t total = 0;
+        for (int b = 0; b < TRACE_BUCKETS; b++) total += totals[s][b];
+        ss << prefix << "  " << TRACE_SPAN_NAMES[s] << ": n=" << total;
+        if (total > 0) {
+            const double quantiles[] = {0.5, 0.9, 0.99, 1.0};
+            const char* labels[] = {"p50", "p90", "p99", "max"};
+            for (int q = 0; q < 4; q++) {
+                uint64_t target = (uint64_t)(quantiles[q] * (total - 1)) + 1, seen = 0;
+                int b = 0;
+                while ((seen += totals[s][b]) < target) b++;
+                ss << " " << labels[q] << "<" << (1ULL << b);
             }
-            
-            // Check if user already logged in
-            {
-                lock_guard<mutex> lock(clientsMutex);
-                bool alreadyLoggedIn = false;
-                for (const auto& client : clients) {
-                    if (client.username == user && client.authenticated) {
-                        alreadyLoggedIn = true;
-                        break;
-                    }
-                }
-                if (alreadyLoggedIn) {
-                    sendToClient(clientSocket, "[ERROR] User already logged in!");
-                    continue;
-                }
+            ss << "\n" << prefix << "    ";
+            for (int b = 0; b < TRACE_BUCKETS; b++) {
+                if (totals[s][b]) ss << " <" << (1ULL << b) << "us:" << totals[s][b];
             }
-            
-            username = user;
-            authenticated = true;
-            sendToClient(clientSocket, "[SUCCESS] Login successful! Welcome to the chat!");
-            
-        } else {
-            sendToClient(clientSocket, "[ERROR] Unknown command. Use /login or /register");
         }
+        ss << "\n";
     }
-    
-    // Add authenticated client to list
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        clients.push_back({clientSocket, username, ipAddr, true});
-        cout << "\n[+] " << username << " logged in from " << ipAddr << endl;
-        cout << "[*] Active users: " << clients.size() << endl;
-    }
-    
-    // Notify all clients
-    string joinMsg = "[SYSTEM] " + username + " joined the chat";
-    broadcastMessage(joinMsg, clientSocket);
-    
-    // Send welcome message
-    string welcome = "[SYSTEM] Type /help for commands";
-    sendToClient(clientSocket, welcome);
-    
-    // Main message loop
+    return ss.str();
+}
+
+void traceDumpLoop() {
     while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        
-        if (bytesReceived <= 0) {
-            break;
+        this_thread::sleep_for(chrono::seconds(TRACE_DUMP_SECONDS));
+        ofstream file(config.traceDumpFile, ios::trunc);
+        if (file.is_open()) {
+            file << "# " << getCurrentTime() << "\n" << buildLatencyReport("");
         }
-        
-        string message(buffer);
-        
-        if (message == "/quit") {
-            break;
-        } else if (message == "/users") {
-            lock_guard<mutex> lock(clientsMutex);
-            stringstream ss;
-            ss << clients.size();
-            string userList = "\n[SYSTEM] === Active Users (" + ss.str() + ") ===\n";
-            for (const auto& c : clients) {
-                if (c.authenticated) {
-                    userList += "[SYSTEM] - " + c.username;
-                    if (c.socket == clientSocket) userList += " (you)";
-                    userList += "\n";
-                }
-            }
-            sendToClient(clientSocket, userList);
-        } else if (message == "/help") {
-            string help = "\n[SYSTEM] === Commands ===\n";
-            help += "[SYSTEM] /users - List all users\n";
-            help += "[SYSTEM] /help - Show this help\n";
-            help += "[SYSTEM] /quit - Leave chat\n";
-            sendToClient(clientSocket, help);
-        } else {
-            string timestamp = getCurrentTime();
-            string fullMessage = "[" + timestamp + "] " + username + ": " + message;
-            
-            // Store in history
-            {
-                lock_guard<mutex> lock(historyMutex);
-                messageHistory["global"].push_back(fullMessage);
-                if (messageHistory["global"].size() > 100) {
-                    messageHistory["global"].erase(messageHistory["global"].begin());
-                }
+    }
+}
+
+void broadcastMessage(const string& message, SOCKET senderSocket, MessageTrace* trace = nullptr) {
+    lock_guard<mutex> lock(clientsMutex);
+    bool traced = trace && trace->sampled;
+    if (traced) {
+        trace->queued = chrono::steady_clock::now();
+        recordSpan(SPAN_PERSIST_QUEUE, trace->persisted, trace->queued);
+    }
+    for (const auto& client : clients) {
+        if (client.socket != senderSocket && client.authenticated) {
+            send(client.socket, message.c_str(), (int)message.length(), 0);
+            if (traced) {
+                TracePoint flushed = chrono::steady_clock::now();
+                recordSpan(SPAN_QUEUE_FLUSH, trace->queued, flushed);
+                recordSpan(SPAN_END_TO_END, trace->read, flushed);
             }
-            
-            // Broadcast to all authenticated clients
-            broadcastMessage(fullMessage, (SOCKET)-1);
-            
-            // Log to server console
-            cout << fullMessage << endl;
         }
     }
-    
-    // Client disconnected
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        clients.erase(
-            remove_if(clients.begin(), clients.end(),
-                [clientSocket](const Client& c) { return c.socket == clientSocket; }),
-            clients.end()
-        );
-        cout << "\n[-] " << username << " left the chat" << endl;
-        cout << "[*] Active users: " << clients.size() << endl;
+}
+
+// ---------------------------------------------------------------------------
+// Message search
+//
+// Stored messages are queued for a background indexer, so the broadcast
+// path only pays for one queue push. The indexer appends to a small mutable
+// segment and seals it every SEGMENT_SEAL_SECONDS (or SEGMENT_SEAL_DOCS)
+// into an immutable segment whose posting lists are varint-encoded deltas
+// of segment-local document ids. Sealed segments that fall into the same
+// time window are merged once the window is over, with windows growing as
+// segments age, and the oldest segments are dropped once the index holds
+// more than --search-max-docs messages. Queries copy the segment list under
+// the lock and score the immutable segments without it. If the indexer falls
+// INDEX_QUEUE_MAX messages behind, the oldest queued ones are skipped and
+// counted in /stats. A hot upgrade hands the index over through a file.
+// ---------------------------------------------------------------------------
+
+const int SEGMENT_SEAL_SECONDS = 10;
+const size_t SEGMENT_SEAL_DOCS = 8192;
+const int SEGMENT_MERGE_INTERVAL_SECONDS = 5;
+const size_t INDEX_QUEUE_MAX = 100000;
+const size_t SEARCH_RESULTS = 10;
+const size_t SEARCH_MAX_TERMS = 32;   // keeps per-document scores within a uint8_t
+const size_t TERM_MAX_LENGTH = 32;
+
+struct IndexedMessage {
+    uint64_t seq;
+    time_t time;
+    string room;
+    string text;
+};
+
+struct IndexSegment {
+    time_t firstTime;
+    time_t lastTime;
+    vector<uint64_t> seqs;
+    vector<uint32_t> roomIds;                 // into `rooms`
+    vector<string> rooms;
+    vector<string> texts;
+    unordered_map<string, string> postings;   // term -> varint delta doc ids
+
+    size_t size() const { return texts.size(); }
+};
+
+struct ActiveSegment {
+    vector<IndexedMessage> docs;
+    unordered_map<string, vector<uint32_t>> postings;
+    time_t opened;
+};
+
+deque<IndexedMessage> indexQueue;
+mutex indexQueueMutex;
+condition_variable indexQueueCv;
+atomic<uint64_t> indexDropped(0);
+
+vector<shared_ptr<const IndexSegment>> sealedSegments;   // oldest first
+ActiveSegment activeSegment;
+mutex indexMutex;
+
+void appendVarint(string& out, uint32_t value) {
+    while (value >= 0x80) {
+        out += (char)((value & 0x7F) | 0x80);
+        value >>= 7;
     }
-    
-    string leaveMsg = "[SYSTEM] " + username + " left the chat";
-    broadcastMessage(leaveMsg, (SOCKET)-1);
-    
-    closeSocket(clientSocket);
+    out += (char)value;
 }
 
-int main() {
-    cout << "+========================================+\n";
-    cout << "|   C++ Messenger Server v2.0            |\n";
-    cout << "|   With User Authentication             |\n";
-#ifdef WINDOWS_BUILD
-    cout << "|        Windows Build                   |\n";
-#else
-    cout << "|        Linux/Unix Build                |\n";
-#endif
-    cout << "+========================================+\n\n";
-    
-    // Load existing users
-    loadUsers();
-    
-#ifdef WINDOWS_BUILD
-    if (!initWinsock()) {
-        return 1;
+void decodePostings(const string& encoded, vector<uint32_t>& docs, uint32_t offset) {
+    uint32_t doc = 0, value = 0;
+    int shift = 0;
+    for (unsigned char byte : encoded) {
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (byte & 0x80) {
+            shift += 7;
+            continue;
+        }
+        doc += value;
+        docs.push_back(doc + offset);
+        value = 0;
+        shift = 0;
     }
-#endif
-    
-    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == INVALID_SOCKET) {
-        cerr << "Error creating socket!" << endl;
-#ifdef WINDOWS_BUILD
-        cleanupWinsock();
-#endif
-        return 1;
+}
+
+string encodePostings(const vector<uint32_t>& docs) {
+    string out;
+    uint32_t previous = 0;
+    for (uint32_t doc : docs) {
+        appendVarint(out, doc - previous);
+        previous = doc;
     }
-    
-    int opt = 1;
-    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-    
-    sockaddr_in serverAddress;
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(8080);
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-    
-if (::bind(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == SOCKET_ERROR) {    cerr << "Error binding socket!" << endl;
-    closeSocket(serverSocket);
-#ifdef WINDOWS_BUILD
-    cleanupWinsock();
-#endif
-    return 1;
+    return out;
 }
-    if (listen(serverSocket, 10) == SOCKET_ERROR) {
-        cerr << "Error listening on socket!" << endl;
-        closeSocket(serverSocket);
-#ifdef WINDOWS_BUILD
-        cleanupWinsock();
-#endif
-        return 1;
+
+// Lowercased runs of letters, digits and '_', deduplicated
+vector<string> tokenize(const string& text) {
+    vector<string> terms;
+    string term;
+    for (size_t i = 0; i <= text.size(); i++) {
+        char c = i < text.size() ? text[i] : ' ';
+        if (isalnum((unsigned char)c) || c == '_') {
+            if (term.size() < TERM_MAX_LENGTH) term += (char)tolower((unsigned char)c);
+        } else if (!term.empty()) {
+            if (find(terms.begin(), terms.end(), term) == terms.end()) terms.push_back(term);
+            term.clear();
+        }
     }
-    
-    cout << "[*] Server started on port 8080" << endl;
-    cout << "[*] Waiting for connections...\n" << endl;
-    
-    while (true) {
+    return terms;
+}
+
+// Terms of a stored "[HH:MM:SS] user: text" line, without the timestamp
+vector<string> messageTerms(const string& message) {
+    size_t start = message.find("] ");
+    return tokenize(start == string::npos ? message : message.substr(start + 2));
+}
+
+void indexMessage(uint64_t seq, const string& room, const string& message) {
+    {
+        lock_guard<mutex> lock(indexQueueMutex);
+        if (indexQueue.size() >= INDEX_QUEUE_MAX) {
+            indexQueue.pop_front();
+            ++indexDropped;
+        }
+        indexQueue.push_back({seq, time(0), room, message});
+    }
+    indexQueueCv.notify_one();
+}
+
+// Call with indexMutex held
+void sealActiveSegment() {
+    if (activeSegment.docs.empty()) return;
+    shared_ptr<IndexSegment> segment(new IndexSegment());
+    segment->firstTime = activeSegment.docs.front().time;
+    segment->lastTime = activeSegment.docs.back().time;
+    for (auto& doc : activeSegment.docs) {
+        auto room = find(segment->rooms.begin(), segment->rooms.end(), doc.room);
+        segment->roomIds.push_back((uint32_t)(room - segment->rooms.begin()));
+        if (room == segment->rooms.end()) segment->rooms.push_back(doc.room);
+        segment->seqs.push_back(doc.seq);
+        segment->texts.push_back(move(doc.text));
+    }
+    for (const auto& entry : activeSegment.postings) {
+        segment->postings[entry.first] = encodePostings(entry.second);
+    }
+    sealedSegments.push_back(segment);
+    activeSegment = ActiveSegment();
+}
+
+// Concatenates adjacent segments, oldest first, copying each one once
+shared_ptr<const IndexSegment> mergeSegments(const vector<shared_ptr<const IndexSegment>>& run) {
+    shared_ptr<IndexSegment> merged(new IndexSegment());
+    merged->firstTime = run.front()->firstTime;
+    merged->lastTime = run.back()->lastTime;
+    unordered_map<string, vector<uint32_t>> postings;
+    for (const auto& part : run) {
+        uint32_t offset = (uint32_t)merged->size();
+        for (size_t i = 0; i < part->size(); i++) {
+            const string& room = part->rooms[part->roomIds[i]];
+            auto it = find(merged->rooms.begin(), merged->rooms.end(), room);
+            merged->roomIds.push_back((uint32_t)(it - merged->rooms.begin()));
+            if (it == merged->rooms.end()) merged->rooms.push_back(room);
+            merged->seqs.push_back(part->seqs[i]);
+            merged->texts.push_back(part->texts[i]);
+        }
+        for (const auto& entry : part->postings) {
+            decodePostings(entry.second, postings[entry.first], offset);
+        }
+    }
+    for (const auto& entry : postings) {
+        merged->postings[entry.first] = encodePostings(entry.second);
+    }
+    return merged;
+}
+
+// Segments younger than a minute stay as sealed; older ones are merged into
+// 10-minute windows, and those older than an hour into 1-hour windows
+struct MergeTier {
+    time_t minAge;
+    time_t window;
+};
+
+const MergeTier MERGE_TIERS[] = {{3600, 3600}, {60, 600}};   // oldest first
+
+const MergeTier* mergeTier(time_t age) {
+    for (const auto& tier : MERGE_TIERS) {
+        if (age >= tier.minAge) return &tier;
+    }
+    return nullptr;
+}
+
+void mergeAndTrimSegments() {
+    vector<shared_ptr<const IndexSegment>> segments;
+    {
+        lock_guard<mutex> lock(indexMutex);
+        segments = sealedSegments;
+    }
+
+    // Only this thread replaces segments, so the snapshot stays accurate.
+    // A window is merged once all of it has aged into its tier, so no later
+    // segment can join it and each message is copied once per tier.
+    time_t now = time(0);
+    for (size_t i = 0; i < segments.size(); i++) {
+        const MergeTier* tier = mergeTier(now - segments[i]->lastTime);
+        if (!tier) break;   // the rest are younger still
+        time_t bucket = segments[i]->firstTime / tier->window;
+        if (now - (bucket + 1) * tier->window < tier->minAge) continue;
+
+        size_t end = i, docs = 0;
+        while (end < segments.size() && mergeTier(now - segments[end]->lastTime) == tier &&
+               segments[end]->firstTime / tier->window == bucket &&
+               segments[end]->lastTime / tier->window == bucket &&
+               docs + segments[end]->size() <= config.searchMaxDocs / 4) {
+            docs += segments[end]->size();
+            end++;
+        }
+        if (end - i < 2) continue;
+
+        vector<shared_ptr<const IndexSegment>> run(segments.begin() + i, segments.begin() + end);
+        shared_ptr<const IndexSegment> merged = mergeSegments(run);
+        {
+            lock_guard<mutex> lock(indexMutex);
+            sealedSegments.erase(sealedSegments.begin() + i + 1, sealedSegments.begin() + end);
+            sealedSegments[i] = merged;
+        }
+        segments.erase(segments.begin() + i + 1, segments.begin() + end);
+        segments[i] = merged;
+    }
+
+    lock_guard<mutex> lock(indexMutex);
+    size_t total = activeSegment.docs.size();
+    for (const auto& segment : sealedSegments) total += segment->size();
+    while (total > config.searchMaxDocs && !sealedSegments.empty()) {
+        total -= sealedSegments.front()->size();
+        sealedSegments.erase(sealedSegments.begin());
+    }
+}
+
+size_t indexedMessageCount() {
+    lock_guard<mutex> lock(indexMutex);
+    size_t total = activeSegment.docs.size();
+    for (const auto& segment : sealedSegments) total += segment->size();
+    return total;
+}
+
+void indexerLoop() {
+    time_t lastMerge = time(0);
+    deque<IndexedMessage> batch;
+    vector<vector<string>> batchTerms;
+    while (true) {
+        {
+            unique_lock<mutex> lock(indexQueueMutex);
+            indexQueueCv.wait_for(lock, chrono::seconds(1), [] { return !indexQueue.empty(); });
+            batch.swap(indexQueue);
+        }
+
+        // Tokenize before taking the index lock so queries aren't held up
+        batchTerms.clear();
+        for (const auto& doc : batch) {
+            batchTerms.push_back(messageTerms(doc.text));
+        }
+
+        {
+            lock_guard<mutex> lock(indexMutex);
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (activeSegment.docs.empty()) activeSegment.opened = time(0);
+                uint32_t docId = (uint32_t)activeSegment.docs.size();
+                for (const auto& term : batchTerms[i]) {
+                    activeSegment.postings[term].push_back(docId);
+                }
+                activeSegment.docs.push_back(move(batch[i]));
+                if (activeSegment.docs.size() >= SEGMENT_SEAL_DOCS) sealActiveSegment();
+            }
+            if (!activeSegment.docs.empty() && time(0) - activeSegment.opened >= SEGMENT_SEAL_SECONDS) {
+                sealActiveSegment();
+            }
+        }
+        batch.clear();
+
+        if (time(0) - lastMerge >= SEGMENT_MERGE_INTERVAL_SECONDS) {
+            mergeAndTrimSegments();
+            lastMerge = time(0);
+        }
+    }
+}
+
+struct SearchHit {
+    size_t score;
+    uint64_t seq;
+    string text;
+
+    bool operator<(const SearchHit& other) const {
+        return score != other.score ? score > other.score : seq > other.seq;
+    }
+};
+
+// Keeps the best SEARCH_RESULTS hits, best first
+void offerHit(vector<SearchHit>& hits, size_t score, uint64_t seq, const string& text) {
+    SearchHit hit = {score, seq, ""};
+    if (hits.size() == SEARCH_RESULTS && !(hit < hits.back())) return;
+    hit.text = text;
+    hits.insert(upper_bound(hits.begin(), hits.end(), hit), hit);
+    if (hits.size() > SEARCH_RESULTS) hits.pop_back();
+}
+
+// Ranks messages by the number of query terms they contain, newest first
+// among equals. Returns the number of matching messages.
+size_t searchMessages(const vector<string>& terms, const string& room, vector<SearchHit>& hits) {
+    size_t matches = 0;
+    vector<shared_ptr<const IndexSegment>> segments;
+    {
+        lock_guard<mutex> lock(indexMutex);
+        segments = sealedSegments;
+
+        vector<uint8_t> scores(activeSegment.docs.size(), 0);
+        for (const auto& term : terms) {
+            auto it = activeSegment.postings.find(term);
+            if (it == activeSegment.postings.end()) continue;
+            for (uint32_t doc : it->second) scores[doc]++;
+        }
+        for (size_t doc = 0; doc < scores.size(); doc++) {
+            const IndexedMessage& message = activeSegment.docs[doc];
+            if (scores[doc] == 0 || (!room.empty() && message.room != room)) continue;
+            matches++;
+            offerHit(hits, scores[doc], message.seq, message.text);
+        }
+    }
+
+    vector<uint32_t> docs;
+    for (auto segment = segments.rbegin(); segment != segments.rend(); ++segment) {
+        const IndexSegment& s = **segment;
+        auto roomIt = find(s.rooms.begin(), s.rooms.end(), room);
+        if (!room.empty() && roomIt == s.rooms.end()) continue;
+        uint32_t roomId = (uint32_t)(roomIt - s.rooms.begin());
+
+        vector<uint8_t> scores(s.size(), 0);
+        for (const auto& term : terms) {
+            auto it = s.postings.find(term);
+            if (it == s.postings.end()) continue;
+            docs.clear();
+            decodePostings(it->second, docs, 0);
+            for (uint32_t doc : docs) scores[doc]++;
+        }
+        for (size_t doc = 0; doc < scores.size(); doc++) {
+            if (scores[doc] == 0 || (!room.empty() && s.roomIds[doc] != roomId)) continue;
+            matches++;
+            offerHit(hits, scores[doc], s.seqs[doc], s.texts[doc]);
+        }
+    }
+    return matches;
+}
+
+string handleSearch(const string& args) {
+    stringstream ss(args);
+    vector<string> words;
+    string word;
+    while (ss >> word) words.push_back(word);
+
+    // A trailing word naming a room restricts the search to that room
+    string room;
+    if (words.size() > 1) {
+        lock_guard<mutex> lock(historyMutex);
+        if (messageHistory.count(words.back())) {
+            room = words.back();
+            words.pop_back();
+        }
+    }
+    string query;
+    for (const auto& w : words) query += (query.empty() ? "" : " ") + w;
+    vector<string> terms = tokenize(query);
+    if (terms.empty()) {
+        return "[ERROR] Usage: /search terms [room]";
+    }
+    if (terms.size() > SEARCH_MAX_TERMS) {
+        return "[ERROR] Too many search terms (max " + to_string(SEARCH_MAX_TERMS) + ")";
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<SearchHit> hits;
+    size_t matches = searchMessages(terms, room, hits);
+    double elapsedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    stringstream out;
+    out.precision(2);
+    out << fixed << "\n[SYSTEM] === Search \"" << query << "\"" << (room.empty() ? "" : " in " + room)
+        << ": " << hits.size() << " of " << matches << " matches (" << elapsedMs << " ms) ===\n";
+    for (const auto& hit : hits) {
+        out << "[SYSTEM] " << hit.text << "\n";
+    }
+    return out.str();
+}
+
+// Appends to the room's history and, unless it's already there, the search
+// index, and returns the message's sequence number
+uint64_t storeHistory(const string& room, const string& message, bool searchable = true) {
+    uint64_t seq = ++messageSeq;
+    if (searchable) indexMessage(seq, room, message);
+    lock_guard<mutex> lock(historyMutex);
+    vector<string>& history = messageHistory[room];
+    history.push_back(message);
+    if (history.size() > HISTORY_LIMIT) {
+        history.erase(history.begin());
+    }
+    return seq;
+}
+
+// Send a whole buffer, retrying on short writes
+bool sendAll(SOCKET socket, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int n = send(socket, data.data() + sent, (int)(data.size() - sent), 0);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Makes blocking reads (and optionally writes) on `socket` fail after `ms`
+void setSocketTimeout(SOCKET socket, int ms, bool includeSend) {
+#ifdef WINDOWS_BUILD
+    DWORD timeout = (DWORD)ms;
+#else
+    timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    if (includeSend) {
+        setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+    }
+}
+
+// Buffered reader for the line / length-prefixed inter-node protocol
+class SocketReader {
+public:
+    explicit SocketReader(SOCKET s) : sock(s) {}
+
+    bool readLine(string& line) {
+        while (true) {
+            size_t pos = pending.find('\n');
+            if (pos != string::npos) {
+                line = pending.substr(0, pos);
+                pending.erase(0, pos + 1);
+                return true;
+            }
+            if (pending.size() > 1024 || !fill()) {
+                return false;
+            }
+        }
+    }
+
+    bool readExact(size_t length, string& out) {
+        while (pending.size() < length) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        out = pending.substr(0, length);
+        pending.erase(0, length);
+        return true;
+    }
+
+private:
+    bool fill() {
+        char buffer[4096];
+        int bytesReceived = recv(sock, buffer, sizeof(buffer), 0);
+        if (bytesReceived <= 0) {
+            return false;
+        }
+        pending.append(buffer, bytesReceived);
+        return true;
+    }
+
+    SOCKET sock;
+    string pending;
+};
+
+// ---------------------------------------------------------------------------
+// Flood control
+//
+// Each session owns token buckets for messages and bytes, touched only by its
+// own thread. Limits shared by all sessions from one IP live in fixed tables
+// of atomic words indexed by a hash of the address, updated with a CAS, so
+// every check is O(1) and takes no lock. Addresses that hash to the same
+// slot share a bucket, which only ever makes the limit stricter.
+// ---------------------------------------------------------------------------
+
+const double FLOOD_BURST_SECONDS = 2.0;
+const double AUTH_BURST = 5.0;
+const int FLOOD_NOTICE_SECONDS = 1;
+
+atomic<uint64_t> floodDelayed(0);
+atomic<uint64_t> floodDropped(0);
+atomic<uint64_t> floodDisconnected(0);
+atomic<uint64_t> authThrottled(0);
+
+const chrono::steady_clock::time_point serverStart = chrono::steady_clock::now();
+
+uint32_t millisSinceStart() {
+    return (uint32_t)chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now() - serverStart).count();
+}
+
+// Token bucket owned by a single thread
+struct TokenBucket {
+    double rate;
+    double capacity;
+    double tokens;
+    chrono::steady_clock::time_point last;
+
+    TokenBucket(double ratePerSecond, double burst)
+        : rate(ratePerSecond), capacity(burst), tokens(burst), last(chrono::steady_clock::now()) {}
+
+    // Returns the seconds to wait until `cost` tokens are available, 0 if
+    // they are now. Takes nothing; see spend().
+    double wait(double cost) {
+        if (rate <= 0) return 0;
+        auto now = chrono::steady_clock::now();
+        tokens = min(capacity, tokens + chrono::duration<double>(now - last).count() * rate);
+        last = now;
+        cost = min(cost, capacity);
+        return tokens >= cost ? 0 : (cost - tokens) / rate;
+    }
+
+    // Takes `cost` tokens that wait() just reported as available
+    void spend(double cost) {
+        if (rate > 0) tokens -= min(cost, capacity);
+    }
+};
+
+// Lock-free token buckets keyed by a hash. Each slot packs the time of the
+// last update (ms since start, high 32 bits) with the bucket's deficit in
+// thousandths of a token (low 32 bits), so an untouched zero slot is full.
+class SharedBucketTable {
+public:
+    SharedBucketTable() : rate(0), capacity(0) {
+        for (auto& slot : slots) slot.store(0, memory_order_relaxed);
+    }
+
+    void configure(double ratePerSecond, double burst) {
+        rate = ratePerSecond;
+        capacity = (uint64_t)(min(burst, 4.0e6) * 1000);
+    }
+
+    bool take(size_t key, double tokens) {
+        if (rate <= 0) return true;
+        atomic<uint64_t>& slot = slotFor(key);
+        uint64_t cost = min((uint64_t)(tokens * 1000), capacity);
+        uint64_t current = slot.load(memory_order_relaxed);
+        while (true) {
+            // Re-read every attempt: a winner may have stored a slightly
+            // later time than ours. A gap further back than that means the
+            // slot sat idle for over 2^31 ms, long enough to be full again.
+            uint32_t now = millisSinceStart();
+            uint32_t stamp = (uint32_t)(current >> 32);
+            int32_t elapsed = (int32_t)(now - stamp);
+            uint64_t deficit = (uint32_t)current;
+            if (elapsed < -CAS_CLOCK_SKEW_MS) {
+                deficit = 0;
+            } else if (elapsed < 0) {
+                now = stamp;
+            } else {
+                uint64_t refill = (uint64_t)(elapsed * rate);   // ms * tokens/s = thousandths
+                deficit = deficit > refill ? deficit - refill : 0;
+            }
+            if (deficit + cost > capacity) {
+                return false;
+            }
+            uint64_t next = ((uint64_t)now << 32) | (deficit + cost);
+            if (slot.compare_exchange_weak(current, next, memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    // Gives back tokens taken by a take() whose charge was then rejected elsewhere
+    void refund(size_t key, double tokens) {
+        if (rate <= 0) return;
+        atomic<uint64_t>& slot = slotFor(key);
+        uint64_t amount = min((uint64_t)(tokens * 1000), capacity);
+        uint64_t current = slot.load(memory_order_relaxed);
+        while (true) {
+            uint64_t deficit = (uint32_t)current;
+            deficit = deficit > amount ? deficit - amount : 0;
+            uint64_t next = (current & 0xFFFFFFFF00000000ULL) | deficit;
+            if (slot.compare_exchange_weak(current, next, memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+
+    double refillSeconds() const {
+        return rate > 0 ? 1.0 / rate : 0;
+    }
+
+private:
+    static const size_t SLOT_COUNT = 4096;   // must match the >> 52 below
+    static const int32_t CAS_CLOCK_SKEW_MS = 1000;
+
+    atomic<uint64_t>& slotFor(size_t key) {
+        return slots[(key * 0x9E3779B97F4A7C15ULL) >> 52];
+    }
+
+    double rate;
+    uint64_t capacity;
+    atomic<uint64_t> slots[SLOT_COUNT];
+};
+
+SharedBucketTable ipMessageBuckets;
+SharedBucketTable ipByteBuckets;
+SharedBucketTable authBuckets;
+
+void configureFloodControl() {
+    ipMessageBuckets.configure(config.ipMessageRate, max(1.0, config.ipMessageRate * FLOOD_BURST_SECONDS));
+    ipByteBuckets.configure(config.ipByteRate, config.ipByteRate * FLOOD_BURST_SECONDS);
+    authBuckets.configure(config.authRate, AUTH_BURST);
+}
+
+enum FloodVerdict { FLOOD_PASS, FLOOD_DROP, FLOOD_DISCONNECT };
+
+// Flood control state of one client thread
+struct SessionLimits {
+    size_t ipKey;
+    TokenBucket messages;
+    TokenBucket bytes;
+    chrono::steady_clock::time_point lastNotice;
+
+    explicit SessionLimits(const string& ipAddress)
+        : ipKey(hash<string>()(ipAddress)),
+          messages(config.sessionMessageRate, max(1.0, config.sessionMessageRate * FLOOD_BURST_SECONDS)),
+          bytes(config.sessionByteRate, config.sessionByteRate * FLOOD_BURST_SECONDS) {}
+};
+
+FloodVerdict penalize() {
+    if (config.floodPenalty == PENALTY_DISCONNECT) {
+        ++floodDisconnected;
+        return FLOOD_DISCONNECT;
+    }
+    ++floodDropped;
+    return FLOOD_DROP;
+}
+
+// Takes one message and `length` bytes from the IP's tables, or nothing
+bool takeIpTokens(size_t ipKey, size_t length) {
+    if (!ipMessageBuckets.take(ipKey, 1)) return false;
+    if (ipByteBuckets.take(ipKey, (double)length)) return true;
+    ipMessageBuckets.refund(ipKey, 1);
+    return false;
+}
+
+// Charges one received line against the session and IP limits, only once
+// every bucket can pay for it, so a rejected line costs nothing. With the
+// delay penalty this sleeps until the line fits, which also stops reading
+// from the socket and pushes back on the client through TCP.
+FloodVerdict admitMessage(SessionLimits& limits, size_t length) {
+    bool delayed = false;
+    double wait = max(limits.messages.wait(1), limits.bytes.wait((double)length));
+    while (wait > 0) {
+        if (config.floodPenalty != PENALTY_DELAY) return penalize();
+        delayed = true;
+        this_thread::sleep_for(chrono::duration<double>(wait));
+        wait = max(limits.messages.wait(1), limits.bytes.wait((double)length));
+    }
+    while (!takeIpTokens(limits.ipKey, length)) {
+        if (config.floodPenalty != PENALTY_DELAY) return penalize();
+        delayed = true;
+        this_thread::sleep_for(chrono::duration<double>(
+            max(ipMessageBuckets.refillSeconds(), 0.001)));
+    }
+    // Session buckets belong to this thread and only refilled meanwhile
+    limits.messages.spend(1);
+    limits.bytes.spend((double)length);
+    if (delayed) ++floodDelayed;
+    return FLOOD_PASS;
+}
+
+FloodVerdict admitAuthAttempt(const SessionLimits& limits) {
+    if (authBuckets.take(limits.ipKey, 1)) return FLOOD_PASS;
+    ++authThrottled;
+    if (config.floodPenalty == PENALTY_DISCONNECT) return FLOOD_DISCONNECT;
+    if (config.floodPenalty == PENALTY_DROP) return FLOOD_DROP;
+    do {
+        this_thread::sleep_for(chrono::duration<double>(authBuckets.refillSeconds()));
+    } while (!authBuckets.take(limits.ipKey, 1));
+    return FLOOD_PASS;
+}
+
+// Rate-limits "slow down" notices so a flooder doesn't get an echo per line
+bool shouldNotify(SessionLimits& limits) {
+    auto now = chrono::steady_clock::now();
+    if (now - limits.lastNotice < chrono::seconds(FLOOD_NOTICE_SECONDS)) return false;
+    limits.lastNotice = now;
+    return true;
+}
+
+// Hot upgrade coordination. While a handoff is in progress, threads that
+// would read from a socket park instead, so unread input stays queued in the
+// kernel for the process that takes the socket over.
+const int HANDOFF_PARK_SECONDS = 3;
+const int HANDOFF_RELAY_FLUSH_MS = 1000;   // time given to peer links to drain
+const int HANDOFF_IO_TIMEOUT_MS = 5000;    // a stuck counterpart aborts the upgrade
+
+atomic<bool> handoffInProgress(false);
+atomic<int> activeConnections(0);
+mutex handoffMutex;
+condition_variable handoffCv;
+vector<pair<SOCKET, SessionState>> parkedSessions;
+#ifndef WINDOWS_BUILD
+int handoffPipe[2] = {-1, -1};   // becomes readable when a handoff starts
+#endif
+
+// Counts a client connection from accept() until its thread is done with it
+struct ConnectionGuard {
+    ~ConnectionGuard() {
+        --activeConnections;
+        handoffCv.notify_all();
+    }
+};
+
+// Blocks until `socket` is readable. Returns false if a hot upgrade started
+// and the caller must not read from the socket.
+bool waitReadable(SOCKET socket) {
+#ifndef WINDOWS_BUILD
+    if (handoffPipe[0] >= 0) {
+        pollfd fds[2] = {{socket, POLLIN, 0}, {handoffPipe[0], POLLIN, 0}};
+        while (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) break;
+        }
+        if ((fds[1].revents & POLLIN) && handoffInProgress) {
+            return false;
+        }
+    }
+#else
+    (void)socket;
+#endif
+    return true;
+}
+
+void waitForHandoffEnd() {
+    unique_lock<mutex> lock(handoffMutex);
+    handoffCv.wait(lock, [] { return !handoffInProgress; });
+}
+
+// Hands a client thread's connection to the upgrade coordinator and blocks.
+// Returns only if the upgrade was aborted and the thread should carry on;
+// on success the process exits while the thread is still parked here.
+void parkForHandoff(SOCKET socket, const SessionState& state) {
+    unique_lock<mutex> lock(handoffMutex);
+    if (!handoffInProgress) return;
+    parkedSessions.push_back(make_pair(socket, state));
+    handoffCv.notify_all();
+    handoffCv.wait(lock, [] { return !handoffInProgress; });
+}
+
+// ---------------------------------------------------------------------------
+// Presence
+//
+// Joins and leaves are not broadcast one by one. They are collected for
+// PRESENCE_FLUSH_MS, with a join and leave of the same user cancelling out,
+// and then sent as a single diff frame. Each flush that changes anything
+// bumps the roster version and pre-serializes the /users snapshot, so
+// /users is served from cache and `/users <version>` can return only the
+// changes since a version the client has already seen.
+// ---------------------------------------------------------------------------
+
+const int PRESENCE_FLUSH_MS = 250;
+const size_t ROSTER_DIFF_HISTORY = 64;
+
+struct PresenceChange {
+    bool joined;
+    string nodeId;      // empty for users on this node
+};
+
+struct RosterDiff {
+    uint64_t version;
+    map<string, PresenceChange> changes;
+};
+
+map<string, PresenceChange> pendingPresence;
+mutex presenceMutex;
+
+map<string, string> presenceRoster;         // username -> node id, owned by presenceLoop
+uint64_t rosterVersion = 0;
+shared_ptr<const string> rosterSnapshot(new string("\n[SYSTEM] === Active Users (0) v0 ===\n"));
+deque<RosterDiff> rosterDiffs;              // the last ROSTER_DIFF_HISTORY versions
+mutex rosterMutex;
+
+void queuePresence(const string& username, bool joined, const string& nodeId) {
+    lock_guard<mutex> lock(presenceMutex);
+    auto it = pendingPresence.find(username);
+    if (it != pendingPresence.end() && it->second.joined != joined) {
+        pendingPresence.erase(it);   // joined and left again within one window
+        return;
+    }
+    pendingPresence[username] = {joined, nodeId};
+}
+
+void announceJoin(const string& username, const string& nodeId = "") {
+    queuePresence(username, true, nodeId);
+}
+
+void announceLeave(const string& username) {
+    queuePresence(username, false, "");
+}
+
+string buildRosterSnapshot(uint64_t version) {
+    stringstream ss;
+    ss << "\n[SYSTEM] === Active Users (" << presenceRoster.size() << ") v" << version << " ===\n";
+    for (const auto& entry : presenceRoster) {
+        ss << "[SYSTEM] - " << entry.first;
+        if (!entry.second.empty()) ss << " (on " << entry.second << ")";
+        ss << "\n";
+    }
+    return ss.str();
+}
+
+// Adds users (username -> node id) without announcing them, for sessions
+// adopted in a hot upgrade. The version moves past the old process's, so
+// clients' cached versions get a full snapshot rather than a wrong delta.
+void seedRoster(const map<string, string>& present, uint64_t previousVersion) {
+    lock_guard<mutex> lock(rosterMutex);
+    presenceRoster.insert(present.begin(), present.end());
+    rosterVersion = previousVersion + 1;
+    rosterSnapshot = make_shared<const string>(buildRosterSnapshot(rosterVersion));
+}
+
+string joinNames(const vector<string>& names, const string& skip) {
+    string out;
+    for (const auto& name : names) {
+        if (name != skip) out += (out.empty() ? "" : ", ") + name;
+    }
+    return out;
+}
+
+// The diff frame of one flush as seen by `self`, who isn't told about their own join
+string presenceFrame(const vector<string>& joined, const vector<string>& left, const string& self) {
+    string frame;
+    string names = joinNames(joined, self);
+    if (!names.empty()) frame += "[SYSTEM] " + names + " joined the chat";
+    if (!left.empty()) {
+        if (!frame.empty()) frame += "\n";
+        frame += "[SYSTEM] " + joinNames(left, "") + " left the chat";
+    }
+    return frame;
+}
+
+void presenceLoop() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(PRESENCE_FLUSH_MS));
+        map<string, PresenceChange> pending;
+        {
+            lock_guard<mutex> lock(presenceMutex);
+            pending.swap(pendingPresence);
+        }
+        if (pending.empty()) continue;
+
+        RosterDiff diff;
+        vector<string> joined, left, localJoined;
+        {
+            lock_guard<mutex> lock(rosterMutex);
+            for (const auto& change : pending) {
+                bool present = presenceRoster.count(change.first) > 0;
+                if (change.second.joined == present) continue;   // e.g. a left-and-rejoined user
+                if (change.second.joined) {
+                    presenceRoster[change.first] = change.second.nodeId;
+                    joined.push_back(change.first);
+                    if (change.second.nodeId.empty()) localJoined.push_back(change.first);
+                } else {
+                    presenceRoster.erase(change.first);
+                    left.push_back(change.first);
+                }
+                diff.changes.insert(change);
+            }
+            if (diff.changes.empty()) continue;
+
+            diff.version = ++rosterVersion;
+            rosterDiffs.push_back(diff);
+            if (rosterDiffs.size() > ROSTER_DIFF_HISTORY) rosterDiffs.pop_front();
+            rosterSnapshot = make_shared<const string>(buildRosterSnapshot(rosterVersion));
+        }
+
+        string frame = presenceFrame(joined, left, "");
+        lock_guard<mutex> lock(clientsMutex);
+        for (const auto& client : clients) {
+            if (!client.authenticated) continue;
+            bool selfJoined = find(localJoined.begin(), localJoined.end(), client.username) != localJoined.end();
+            string own = selfJoined ? presenceFrame(joined, left, client.username) : frame;
+            if (!own.empty()) send(client.socket, own.c_str(), (int)own.length(), 0);
+        }
+    }
+}
+
+// Full snapshot, or only the net changes after `sinceVersion` while those
+// are still retained
+string rosterReply(bool wantsDelta, uint64_t sinceVersion) {
+    lock_guard<mutex> lock(rosterMutex);
+    if (!wantsDelta || sinceVersion > rosterVersion ||
+        (sinceVersion < rosterVersion &&
+         (rosterDiffs.empty() || rosterDiffs.front().version > sinceVersion + 1))) {
+        return *rosterSnapshot;
+    }
+
+    map<string, bool> net;   // username -> present now
+    for (const auto& diff : rosterDiffs) {
+        if (diff.version <= sinceVersion) continue;
+        for (const auto& change : diff.changes) {
+            auto it = net.find(change.first);
+            if (it != net.end() && it->second != change.second.joined) {
+                net.erase(it);   // back to what the client already has
+            } else {
+                net[change.first] = change.second.joined;
+            }
+        }
+    }
+    stringstream ss;
+    ss << "\n[SYSTEM] === Roster v" << rosterVersion << " (changes since v" << sinceVersion << ") ===\n";
+    for (const auto& entry : net) {
+        ss << "[SYSTEM] " << (entry.second ? "+ " : "- ") << entry.first << "\n";
+    }
+    return ss.str();
+}
+
+// ---------------------------------------------------------------------------
+// Cluster relay
+//
+// Every node dials every peer listed with --peer and sends its records over
+// that outbound link; the peer only answers with acknowledgements. Nodes form
+// a full mesh, so relayed records are never forwarded again.
+//
+// The cluster port listens on loopback unless --cluster-bind says otherwise,
+// and a peer whose HELLO lacks the --cluster-secret is dropped, since relayed
+// records are trusted like local users.
+//
+// Wire format (all integers in decimal text), sender to receiver:
+//   HELLO <nodeId> <epoch> <firstSeq> [secret]\n   once per connection
+//   ROSTER <len>\n<user user ...>             users currently on the sender
+//   BATCH <seq> <count> <len>\n<records>      records: <TYPE> <len>\n<payload>
+//   PING\n                                    keeps idle links checked
+// and receiver to sender, after HELLO and every BATCH or PING:
+//   ACK <seq>\n                               last seq applied
+//
+// Batch sequence numbers increase per sender epoch (process start). A sender
+// keeps up to RELAY_WINDOW batches until they are acknowledged and resends
+// them after a reconnect, starting at <firstSeq>; receivers drop any seq
+// they have already applied.
+// ---------------------------------------------------------------------------
+
+const int RELAY_FLUSH_MS = 5;
+const size_t RELAY_BATCH_MAX = 256;
+const size_t RELAY_WINDOW = 64;            // unacknowledged batches per link
+const size_t RELAY_QUEUE_MAX = 65536;
+const size_t RELAY_FRAME_MAX = 16 * 1024 * 1024;
+const int RELAY_RECONNECT_MS = 1000;
+const int RELAY_HEARTBEAT_MS = 1000;
+const int RELAY_READ_TIMEOUT_MS = 4 * RELAY_HEARTBEAT_MS;   // peer gone without a FIN
+const int NODE_GRACE_SECONDS = 10;
+
+struct RelayRecord {
+    string type;     // MSG, JOIN, LEAVE or USER
+    string payload;
+};
+
+struct RelayBatch {
+    uint64_t seq;
+    vector<RelayRecord> records;
+};
+
+struct PeerLink {
+    string host;
+    int port;
+    mutex queueMutex;
+    condition_variable queueCv;
+    deque<RelayRecord> queue;
+    deque<RelayBatch> unacked;      // sent or about to be, oldest first
+    uint64_t nextSeq;
+    bool sending;                   // a write to the peer is in progress
+    bool broken;                    // the connection's ack reader has stopped
+    bool frozen;                    // a hot upgrade is collecting pending records
+};
+
+struct RemoteNode {
+    uint64_t epoch;
+    uint64_t lastSeq;
+    bool connected;
+    uint64_t generation;     // bumped per inbound link; only the newest may mark the node down
+    chrono::steady_clock::time_point downSince;
+};
+
+vector<unique_ptr<PeerLink>> peerLinks;
+uint64_t nodeEpoch = 0;
+
+map<string, string> remoteUsers;      // username -> node id
+map<string, RemoteNode> remoteNodes;
+mutex remoteMutex;
+
+bool clusterEnabled() {
+    return config.clusterPort != 0;
+}
+
+bool isRemoteUser(const string& username) {
+    lock_guard<mutex> lock(remoteMutex);
+    return remoteUsers.find(username) != remoteUsers.end();
+}
+
+void relayToPeers(const string& type, const string& payload) {
+    for (auto& link : peerLinks) {
+        {
+            lock_guard<mutex> lock(link->queueMutex);
+            // A peer that stays down must not grow the queue without bound;
+            // presence is resynchronised by ROSTER on reconnect anyway.
+            if (link->queue.size() >= RELAY_QUEUE_MAX) {
+                link->queue.pop_front();
+            }
+            link->queue.push_back({type, payload});
+        }
+        link->queueCv.notify_all();
+    }
+}
+
+string localRosterPayload() {
+    lock_guard<mutex> lock(clientsMutex);
+    string roster;
+    for (const auto& c : clients) {
+        if (c.authenticated) {
+            if (!roster.empty()) roster += " ";
+            roster += c.username;
+        }
+    }
+    return roster;
+}
+
+SOCKET connectToPeer(const string& host, int port) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0) {
+        return INVALID_SOCKET;
+    }
+
+    SOCKET s = INVALID_SOCKET;
+    for (addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET) continue;
+        if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0) break;
+        closeSocket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    return s;
+}
+
+string encodeBatch(uint64_t seq, const vector<RelayRecord>& records) {
+    string body;
+    for (const auto& r : records) {
+        body += r.type + " " + to_string(r.payload.size()) + "\n" + r.payload;
+    }
+    return "BATCH " + to_string(seq) + " " + to_string(records.size()) + " " +
+           to_string(body.size()) + "\n" + body;
+}
+
+// Drops the batches the peer acknowledges on the outbound connection `s`
+void peerAckLoop(PeerLink* link, SOCKET s) {
+    SocketReader reader(s);
+    string line, action;
+    while (reader.readLine(line)) {
+        stringstream ack(line);
+        uint64_t seq = 0;
+        ack >> action >> seq;
+        if (action != "ACK") break;
+        {
+            lock_guard<mutex> lock(link->queueMutex);
+            while (!link->unacked.empty() && link->unacked.front().seq <= seq) {
+                link->unacked.pop_front();
+            }
+        }
+        link->queueCv.notify_all();
+    }
+    {
+        lock_guard<mutex> lock(link->queueMutex);
+        link->broken = true;
+    }
+    link->queueCv.notify_all();
+}
+
+void peerSenderLoop(PeerLink* link) {
+    while (true) {
+        SOCKET s = connectToPeer(link->host, link->port);
+        if (s == INVALID_SOCKET) {
+            this_thread::sleep_for(chrono::milliseconds(RELAY_RECONNECT_MS));
+            continue;
+        }
+        cout << "[*] Cluster link up -> " << link->host << ":" << link->port << endl;
+        // The peer acknowledges every PING, so a silent link is a dead one
+        setSocketTimeout(s, RELAY_READ_TIMEOUT_MS, true);
+
+        uint64_t sentSeq;   // last batch written on this connection
+        {
+            lock_guard<mutex> lock(link->queueMutex);
+            sentSeq = (link->unacked.empty() ? link->nextSeq : link->unacked.front().seq) - 1;
+            link->broken = false;
+        }
+        thread ackReader(peerAckLoop, link, s);
+
+        string roster = localRosterPayload();
+        bool ok = sendAll(s, "HELLO " + config.nodeId + " " + to_string(nodeEpoch) + " " +
+                             to_string(sentSeq + 1) + " " + config.clusterSecret + "\n") &&
+                  sendAll(s, "ROSTER " + to_string(roster.size()) + "\n" + roster);
+
+        while (ok) {
+            string frame;
+            {
+                unique_lock<mutex> lock(link->queueMutex);
+                auto unsent = [link, &sentSeq] {
+                    return !link->unacked.empty() && link->unacked.back().seq > sentSeq;
+                };
+                auto ready = [link, &unsent] {
+                    return link->broken || (!link->frozen && (unsent() ||
+                           (!link->queue.empty() && link->unacked.size() < RELAY_WINDOW)));
+                };
+                // An idle link only notices that the peer went away when
+                // it writes, and the peer needs our ROSTER again once it's back
+                if (!link->queueCv.wait_for(lock, chrono::milliseconds(RELAY_HEARTBEAT_MS), ready)) {
+                    if (link->frozen) continue;
+                    frame = "PING\n";
+                } else if (link->broken) {
+                    break;
+                } else {
+                    if (!unsent()) {
+                        // Let concurrent producers fill the frame before flushing it
+                        link->queueCv.wait_for(lock, chrono::milliseconds(RELAY_FLUSH_MS),
+                            [link] { return link->queue.size() >= RELAY_BATCH_MAX; });
+                        RelayBatch batch;
+                        batch.seq = link->nextSeq++;
+                        while (!link->queue.empty() && batch.records.size() < RELAY_BATCH_MAX) {
+                            batch.records.push_back(move(link->queue.front()));
+                            link->queue.pop_front();
+                        }
+                        link->unacked.push_back(move(batch));
+                    }
+                    // Batches the peer acknowledged from an earlier connection are gone
+                    sentSeq = max(sentSeq, link->unacked.front().seq - 1);
+                    const RelayBatch& batch = link->unacked[sentSeq + 1 - link->unacked.front().seq];
+                    frame = encodeBatch(batch.seq, batch.records);
+                    sentSeq = batch.seq;
+                }
+                link->sending = true;
+            }
+
+            ok = sendAll(s, frame);
+            {
+                lock_guard<mutex> lock(link->queueMutex);
+                link->sending = false;
+            }
+            link->queueCv.notify_all();
+        }
+
+        cout << "[!] Cluster link down -> " << link->host << ":" << link->port << endl;
+        shutdownSocket(s);
+        ackReader.join();
+        closeSocket(s);
+        this_thread::sleep_for(chrono::milliseconds(RELAY_RECONNECT_MS));
+    }
+}
+
+// Relay records a hot upgrade carries over: "host:port" of the link and record
+typedef vector<pair<string, RelayRecord>> PendingRelays;
+
+PendingRelays adoptedRelays;   // filled by takeOver, queued by startCluster
+
+// Gives connected links up to `waitMs` to drain, then stops all senders and
+// returns what they have not delivered yet
+PendingRelays freezeRelays(int waitMs) {
+    PendingRelays pending;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(waitMs);
+    for (auto& link : peerLinks) {
+        unique_lock<mutex> lock(link->queueMutex);
+        link->queueCv.wait_until(lock, deadline,
+            [&link] { return link->queue.empty() && link->unacked.empty(); });
+        link->frozen = true;
+        link->queueCv.wait_until(lock, deadline, [&link] { return !link->sending; });
+
+        string address = link->host + ":" + to_string(link->port);
+        for (const auto& batch : link->unacked) {
+            for (const auto& record : batch.records) pending.push_back(make_pair(address, record));
+        }
+        for (const auto& record : link->queue) pending.push_back(make_pair(address, record));
+    }
+    return pending;
+}
+
+void unfreezeRelays() {
+    for (auto& link : peerLinks) {
+        {
+            lock_guard<mutex> lock(link->queueMutex);
+            link->frozen = false;
+        }
+        link->queueCv.notify_all();
+    }
+}
+
+// Reconcile the users we know on `nodeId` with the roster it just sent us
+void applyRoster(const string& nodeId, const string& payload) {
+    stringstream ss(payload);
+    vector<string> roster;
+    string user;
+    while (ss >> user) roster.push_back(user);
+
+    vector<string> joined, left;
+    {
+        lock_guard<mutex> lock(remoteMutex);
+        for (auto it = remoteUsers.begin(); it != remoteUsers.end();) {
+            if (it->second == nodeId && find(roster.begin(), roster.end(), it->first) == roster.end()) {
+                left.push_back(it->first);
+                it = remoteUsers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (const auto& u : roster) {
+            if (remoteUsers.find(u) == remoteUsers.end()) {
+                remoteUsers[u] = nodeId;
+                joined.push_back(u);
+            }
+        }
+    }
+    for (const auto& u : left) announceLeave(u);
+    for (const auto& u : joined) announceJoin(u, nodeId);
+}
+
+void applyRelayRecord(const string& nodeId, const string& type, const string& payload) {
+    if (type == "MSG") {
+        size_t space = payload.find(' ');
+        if (space == string::npos) return;
+        string room = payload.substr(0, space);
+        string message = payload.substr(space + 1);
+        storeHistory(room, message);
+        broadcastMessage(message, (SOCKET)-1);
+        cout << message << endl;
+    } else if (type == "JOIN") {
+        {
+            lock_guard<mutex> lock(remoteMutex);
+            if (remoteUsers.count(payload)) return;
+            remoteUsers[payload] = nodeId;
+        }
+        cout << "\n[+] " << payload << " logged in on node " << nodeId << endl;
+        announceJoin(payload, nodeId);
+    } else if (type == "USER") {
+        // Account registered on another node: "<username> <passwordHash>"
+        stringstream ss(payload);
+        string username, passwordHash;
+        ss >> username >> passwordHash;
+        if (username.empty() || passwordHash.empty() || userExists(username)) return;
+        {
+            lock_guard<mutex> lock(usersMutex);
+            users[username] = {username, passwordHash};
+        }
+        saveUser(username, passwordHash);
+    } else if (type == "LEAVE") {
+        {
+            lock_guard<mutex> lock(remoteMutex);
+            auto it = remoteUsers.find(payload);
+            if (it == remoteUsers.end() || it->second != nodeId) return;
+            remoteUsers.erase(it);
+        }
+        cout << "\n[-] " << payload << " left node " << nodeId << endl;
+        announceLeave(payload);
+    }
+}
+
+// Compares without an early exit, so timing doesn't reveal the secret
+bool sameSecret(const string& given, const string& expected) {
+    unsigned char diff = given.size() == expected.size() ? 0 : 1;
+    for (size_t i = 0; i < given.size(); i++) {
+        diff |= (unsigned char)(given[i] ^ expected[i % max<size_t>(expected.size(), 1)]);
+    }
+    return diff == 0;
+}
+
+// Reads relay frames from one inbound peer connection
+void handlePeer(SOCKET peerSocket, string peerIp) {
+    SocketReader reader(peerSocket);
+    string line, action, nodeId, secret;
+    uint64_t epoch = 0, firstSeq = 0, generation = 0, lastSeq = 0;
+    setSocketTimeout(peerSocket, RELAY_READ_TIMEOUT_MS, true);
+
+    if (!reader.readLine(line)) {
+        closeSocket(peerSocket);
+        return;
+    }
+    stringstream hello(line);
+    hello >> action >> nodeId >> epoch >> firstSeq >> secret;
+    if (action != "HELLO" || nodeId.empty() || nodeId == config.nodeId || firstSeq == 0) {
+        closeSocket(peerSocket);
+        return;
+    }
+    if (!sameSecret(secret, config.clusterSecret)) {
+        cerr << "[!] Rejected cluster link from " << peerIp << " (" << nodeId
+             << "): wrong cluster secret" << endl;
+        closeSocket(peerSocket);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(remoteMutex);
+        RemoteNode& node = remoteNodes[nodeId];
+        if (node.epoch != epoch || node.lastSeq + 1 < firstSeq) {
+            // Either side restarted: everything before firstSeq was acknowledged
+            node.epoch = epoch;
+            node.lastSeq = firstSeq - 1;
+        }
+        node.connected = true;
+        generation = ++node.generation;
+        lastSeq = node.lastSeq;
+    }
+    cout << "[*] Cluster node " << nodeId << " connected" << endl;
+    bool ok = sendAll(peerSocket, "ACK " + to_string(lastSeq) + "\n");
+
+    while (ok && reader.readLine(line)) {
+        stringstream header(line);
+        uint64_t seq = 0;
+        size_t count = 0, length = 0;
+        string body;
+        header >> action;
+
+        if (action == "PING") {
+            ok = sendAll(peerSocket, "ACK " + to_string(lastSeq) + "\n");
+            continue;
+        }
+        if (action == "ROSTER") {
+            header >> length;
+            if (length > RELAY_FRAME_MAX || !reader.readExact(length, body)) break;
+            applyRoster(nodeId, body);
+            continue;
+        }
+        if (action != "BATCH") break;
+
+        header >> seq >> count >> length;
+        if (length > RELAY_FRAME_MAX || !reader.readExact(length, body)) break;
+        bool duplicate;
+        {
+            lock_guard<mutex> lock(remoteMutex);
+            RemoteNode& node = remoteNodes[nodeId];
+            duplicate = seq <= node.lastSeq;   // already applied before a reconnect
+            if (!duplicate) {
+                if (seq != node.lastSeq + 1) {
+                    cerr << "[!] Relay gap from " << nodeId << ": expected seq "
+                         << node.lastSeq + 1 << ", got " << seq << endl;
+                }
+                node.lastSeq = seq;
+            }
+            lastSeq = node.lastSeq;
+        }
+
+        size_t pos = 0;
+        for (size_t i = 0; i < count && !duplicate; i++) {
+            size_t newline = body.find('\n', pos);
+            if (newline == string::npos) break;
+            stringstream recordHeader(body.substr(pos, newline - pos));
+            string type;
+            size_t payloadLength = 0;
+            recordHeader >> type >> payloadLength;
+            pos = newline + 1;
+            if (pos + payloadLength > body.size()) break;
+            applyRelayRecord(nodeId, type, body.substr(pos, payloadLength));
+            pos += payloadLength;
+        }
+        ok = sendAll(peerSocket, "ACK " + to_string(lastSeq) + "\n");
+    }
+
+    {
+        lock_guard<mutex> lock(remoteMutex);
+        RemoteNode& node = remoteNodes[nodeId];
+        if (node.generation == generation) {
+            node.connected = false;
+            node.downSince = chrono::steady_clock::now();
+        }
+    }
+    cout << "[!] Cluster node " << nodeId << " disconnected" << endl;
+    closeSocket(peerSocket);
+}
+
+// Drops users of nodes whose link has been down longer than the grace period,
+// so a short network blip or a restarting peer doesn't flap everyone's presence
+void clusterMaintenanceLoop() {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(1));
+        vector<string> expired;
+        {
+            lock_guard<mutex> lock(remoteMutex);
+            auto now = chrono::steady_clock::now();
+            for (auto& entry : remoteNodes) {
+                RemoteNode& node = entry.second;
+                if (node.connected || now - node.downSince < chrono::seconds(NODE_GRACE_SECONDS)) {
+                    continue;
+                }
+                for (auto it = remoteUsers.begin(); it != remoteUsers.end();) {
+                    if (it->second == entry.first) {
+                        expired.push_back(it->first);
+                        it = remoteUsers.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+        }
+        for (const auto& u : expired) announceLeave(u);
+    }
+}
+
+void clusterListenLoop(SOCKET listener) {
+    while (true) {
+        if (!waitReadable(listener)) {
+            waitForHandoffEnd();
+            continue;
+        }
+        sockaddr_in peerAddr;
+        socklen_t peerAddrLen = sizeof(peerAddr);
+        SOCKET peerSocket = accept(listener, (struct sockaddr*)&peerAddr, &peerAddrLen);
+        if (peerSocket == INVALID_SOCKET) {
+            cerr << "Error accepting cluster connection!" << endl;
+            continue;
+        }
+        thread(handlePeer, peerSocket, string(inet_ntoa(peerAddr.sin_addr))).detach();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// File transfer
+//
+// "/send <user|room> <name> <size>" on the chat connection registers a
+// transfer and answers "[FILE] upload <id> <token> <name>" on a line of its
+// own, so it can be told apart from chat text sharing the recv. The client then
+// opens a separate data connection to the same port and sends
+// "/upload <id> <token>"; the server answers "READY <offset>\n" with the
+// number of bytes it already has, and the client streams the rest as chunks:
+// a 4-byte big-endian length followed by that many bytes, ending with a zero
+// length. Downloads use "/fetch <id>" on the chat connection (answered with
+// "[FILE] download <id> <token> <name> <size>" the same way) and
+// "/download <id> <token> <offset>" on a data connection, answered with
+// "READY <offset>\n" and the same chunk framing. The greeting every new
+// connection gets precedes READY, so clients skip anything before it.
+//
+// File bytes never share a socket with chat text, and data sockets are
+// marked as bulk traffic, so chat is not queued behind them. On Linux,
+// uploads are spliced from the socket into the spool file and downloads are
+// sent with sendfile, without copying through user space. A transfer that
+// breaks off resumes from the last complete chunk: re-sending the same file
+// to the same target reuses the transfer.
+//
+// A data connection that sends or accepts nothing for TRANSFER_IDLE_MS is
+// dropped, which also frees its transfer for a resume. Transfers, and their
+// spool files, are kept for TRANSFER_KEEP_PARTIAL_SECONDS after the last
+// activity while incomplete and TRANSFER_KEEP_COMPLETE_SECONDS once complete,
+// and /send is refused while the spool holds --spool-max-mb. A hot upgrade
+// hands the transfer table over but not the data connections, which don't
+// park: running transfers break off and resume against the new process.
+// ---------------------------------------------------------------------------
+
+const uint32_t TRANSFER_CHUNK_SIZE = 64 * 1024;
+const int TRANSFER_IDLE_MS = 30000;
+const int TRANSFER_KEEP_PARTIAL_SECONDS = 60 * 60;
+const int TRANSFER_KEEP_COMPLETE_SECONDS = 24 * 60 * 60;
+const int TRANSFER_SWEEP_SECONDS = 60;
+#ifndef O_BINARY
+    #define O_BINARY 0
+#endif
+
+struct FileTransfer {
+    uint64_t id;
+    string token;
+    string sender;
+    string target;
+    bool targetIsRoom;
+    string name;
+    uint64_t size;
+    uint64_t received;
+    bool uploading;
+    bool complete;
+    chrono::steady_clock::time_point lastActivity;
+    int downloads;      // data connections currently reading the file
+};
+
+map<uint64_t, FileTransfer> transfers;
+uint64_t nextTransferId = 1;
+mutex transfersMutex;
+
+// 128 bits straight from the OS generator; a seeded PRNG's output could be
+// collected through /send and used to predict other users' tokens
+string newTransferToken() {
+    random_device source;
+    stringstream ss;
+    ss << hex << setfill('0');
+    for (int i = 0; i < 4; i++) ss << setw(8) << (uint32_t)source();
+    return ss.str();
+}
+
+// Control replies go on a line of their own, see above
+string fileControlLine(const string& body) {
+    return "\n[FILE] " + body + "\n";
+}
+
+string spoolPath(uint64_t id) {
+    return config.spoolDir + "/" + to_string(id) + ".spool";
+}
+
+// Marks a data socket as bulk traffic so the kernel queues it behind chat
+void setBulkPriority(SOCKET socket) {
+#ifdef SO_PRIORITY
+    int priority = 1;
+    setsockopt(socket, SOL_SOCKET, SO_PRIORITY, (char*)&priority, sizeof(priority));
+#else
+    (void)socket;
+#endif
+}
+
+bool recvAll(SOCKET socket, char* data, size_t length) {
+    while (length > 0) {
+        int n = recv(socket, data, (int)length, 0);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+string formatThroughput(uint64_t bytes, chrono::steady_clock::duration elapsed) {
+    double seconds = max(chrono::duration<double>(elapsed).count(), 1e-6);
+    stringstream ss;
+    ss.precision(2);
+    ss << fixed << bytes << " bytes in " << seconds << " s (" << bytes / seconds / (1024 * 1024) << " MB/s)";
+    return ss.str();
+}
+
+bool isLocalUser(const string& username) {
+    lock_guard<mutex> lock(clientsMutex);
+    for (const auto& c : clients) {
+        if (c.authenticated && c.username == username) return true;
+    }
+    return false;
+}
+
+void sendToUser(const string& username, const string& message) {
+    lock_guard<mutex> lock(clientsMutex);
+    for (const auto& c : clients) {
+        if (c.authenticated && c.username == username) {
+            send(c.socket, message.c_str(), (int)message.length(), 0);
+        }
+    }
+}
+
+// "/send <user|room> <name> <size>" from a logged-in client
+string handleSendCommand(const string& sender, const string& args) {
+    stringstream ss(args);
+    string target, name;
+    uint64_t size = 0;
+    ss >> target >> name >> size;
+    if (target.empty() || name.empty() || name.find('/') != string::npos || name.find('\\') != string::npos) {
+        return "[ERROR] Usage: /send user|room file";
+    }
+
+    bool targetIsRoom;
+    {
+        lock_guard<mutex> lock(historyMutex);
+        targetIsRoom = target == DEFAULT_ROOM || messageHistory.count(target) > 0;
+    }
+    if (!targetIsRoom && !isLocalUser(target)) {
+        return isRemoteUser(target)
+            ? "[ERROR] " + target + " is on another node; files can only be sent within a node"
+            : "[ERROR] No such user or room: " + target;
+    }
+
+    lock_guard<mutex> lock(transfersMutex);
+    // Every transfer still in the table holds its declared size in the spool,
+    // finished or not, until it expires
+    uint64_t spooled = 0;
+    for (auto& entry : transfers) {
+        FileTransfer& t = entry.second;
+        if (!t.complete && t.sender == sender && t.target == target && t.name == name && t.size == size) {
+            return fileControlLine("upload " + to_string(t.id) + " " + t.token + " " + t.name);   // resume
+        }
+        spooled += min(t.size, config.spoolMaxBytes);
+    }
+    // Compared without adding, as `size` comes straight from the client
+    if (size > config.spoolMaxBytes || spooled > config.spoolMaxBytes - size) {
+        return "[ERROR] The server's file storage is full, try again later";
+    }
+    FileTransfer t = {nextTransferId++, newTransferToken(), sender, target, targetIsRoom,
+                      name, size, 0, false, false, chrono::steady_clock::now(), 0};
+    transfers[t.id] = t;
+    ofstream(spoolPath(t.id), ios::binary | ios::trunc);
+    return fileControlLine("upload " + to_string(t.id) + " " + t.token + " " + t.name);
+}
+
+// "/fetch <id>" from a logged-in client
+string handleFetchCommand(const string& requester, const string& args) {
+    uint64_t id = 0;
+    stringstream(args) >> id;
+    lock_guard<mutex> lock(transfersMutex);
+    auto it = transfers.find(id);
+    if (it == transfers.end() || !it->second.complete ||
+        !(it->second.targetIsRoom || it->second.target == requester || it->second.sender == requester)) {
+        return "[ERROR] No such file: " + args;
+    }
+    const FileTransfer& t = it->second;
+    return fileControlLine("download " + to_string(t.id) + " " + t.token + " " + t.name + " " + to_string(t.size));
+}
+
+// Writes `length` bytes from the socket to the file at its current position
+bool receiveChunk(SOCKET socket, int fd, uint32_t length) {
+#ifdef __linux__
+    int pipefd[2];
+    if (pipe(pipefd) != 0) return false;
+    bool ok = true;
+    while (ok && length > 0) {
+        ssize_t in = splice(socket, nullptr, pipefd[1], nullptr, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+        ok = in > 0;
+        for (ssize_t pending = in; ok && pending > 0;) {
+            ssize_t out = splice(pipefd[0], nullptr, fd, nullptr, pending, SPLICE_F_MOVE);
+            ok = out > 0;
+            pending -= out;
+        }
+        if (ok) length -= (uint32_t)in;
+    }
+    ::close(pipefd[0]);
+    ::close(pipefd[1]);
+    return ok;
+#else
+    char buffer[TRANSFER_CHUNK_SIZE];
+    while (length > 0) {
+        int n = recv(socket, buffer, (int)min<uint32_t>(length, sizeof(buffer)), 0);
+        if (n <= 0 || write(fd, buffer, n) != n) return false;
+        length -= n;
+    }
+    return true;
+#endif
+}
+
+// Sends `length` bytes of the file starting at `offset`
+bool sendChunk(SOCKET socket, int fd, uint64_t offset, uint32_t length) {
+#ifdef __linux__
+    off_t position = (off_t)offset;
+    while (length > 0) {
+        ssize_t n = sendfile(socket, fd, &position, length);
+        if (n <= 0) return false;
+        length -= (uint32_t)n;
+    }
+    return true;
+#else
+    char buffer[TRANSFER_CHUNK_SIZE];
+    if (lseek(fd, (long)offset, SEEK_SET) < 0) return false;
+    while (length > 0) {
+        int n = read(fd, buffer, min<uint32_t>(length, sizeof(buffer)));
+        if (n <= 0 || !sendAll(socket, string(buffer, n))) return false;
+        length -= n;
+    }
+    return true;
+#endif
+}
+
+// `bytes` and `elapsed` cover the last upload connection, from READY to its final chunk
+void finishUpload(const FileTransfer& t, uint64_t bytes, chrono::steady_clock::duration duration) {
+    string elapsed = formatThroughput(bytes, duration);
+    cout << "[*] File " << t.id << " (" << t.name << ") from " << t.sender << ": " << elapsed << endl;
+    sendToUser(t.sender, "[FILE] " + t.name + " uploaded: " + elapsed);
+
+    string offer = "[FILE] " + t.sender + " sent " + t.name + " (" + to_string(t.size) +
+                   " bytes). Use /fetch " + to_string(t.id) + " to download";
+    if (t.targetIsRoom) {
+        broadcastMessage(offer, (SOCKET)-1);
+    } else {
+        sendToUser(t.target, offer);
+    }
+}
+
+void handleUpload(SOCKET socket, uint64_t id, const string& token) {
+    FileTransfer t;
+    {
+        lock_guard<mutex> lock(transfersMutex);
+        auto it = transfers.find(id);
+        if (it == transfers.end() || it->second.token != token || it->second.uploading || it->second.complete) {
+            return;
+        }
+        it->second.uploading = true;
+        t = it->second;
+    }
+
+    int fd = open(spoolPath(id).c_str(), O_WRONLY | O_CREAT | O_BINARY, 0600);
+    // Bytes past the last complete chunk may be a torn write from a broken connection
+    bool ok = fd >= 0 && ftruncate(fd, (off_t)t.received) == 0 && lseek(fd, (off_t)t.received, SEEK_SET) >= 0 &&
+              sendAll(socket, "READY " + to_string(t.received) + "\n");
+    auto started = chrono::steady_clock::now();
+    uint64_t resumedAt = t.received;
+    uint64_t received = t.received;
+    while (ok) {
+        uint32_t length = 0;
+        if (!recvAll(socket, (char*)&length, sizeof(length))) break;
+        length = ntohl(length);
+        if (length == 0 || length > TRANSFER_CHUNK_SIZE || received + length > t.size) break;
+        if (!receiveChunk(socket, fd, length)) break;
+        received += length;
+        lock_guard<mutex> lock(transfersMutex);
+        transfers[id].received = received;
+        transfers[id].lastActivity = chrono::steady_clock::now();
+    }
+    if (fd >= 0) ::close(fd);
+    auto finished = chrono::steady_clock::now();
+
+    bool complete;
+    {
+        lock_guard<mutex> lock(transfersMutex);
+        FileTransfer& current = transfers[id];
+        current.uploading = false;
+        current.complete = complete = current.received == current.size;
+        t = current;
+    }
+    if (complete) {
+        finishUpload(t, received - resumedAt, finished - started);
+    } else {
+        cout << "[*] File " << id << " upload paused at " << received << "/" << t.size << " bytes" << endl;
+    }
+}
+
+void handleDownload(SOCKET socket, uint64_t id, const string& token, uint64_t offset) {
+    FileTransfer t;
+    {
+        lock_guard<mutex> lock(transfersMutex);
+        auto it = transfers.find(id);
+        if (it == transfers.end() || it->second.token != token || !it->second.complete) return;
+        it->second.downloads++;
+        it->second.lastActivity = chrono::steady_clock::now();
+        t = it->second;
+    }
+
+    int fd = open(spoolPath(id).c_str(), O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        lock_guard<mutex> lock(transfersMutex);
+        transfers[id].downloads--;
+        return;
+    }
+    auto started = chrono::steady_clock::now();
+    uint64_t position = min(offset, t.size);
+    bool ok = sendAll(socket, "READY " + to_string(position) + "\n");
+    while (ok && position < t.size) {
+        uint32_t length = (uint32_t)min<uint64_t>(TRANSFER_CHUNK_SIZE, t.size - position);
+        uint32_t header = htonl(length);
+        ok = sendAll(socket, string((const char*)&header, sizeof(header))) && sendChunk(socket, fd, position, length);
+        if (ok) position += length;
+    }
+    ::close(fd);
+    {
+        lock_guard<mutex> lock(transfersMutex);
+        transfers[id].downloads--;
+        transfers[id].lastActivity = chrono::steady_clock::now();
+    }
+    if (ok) {
+        uint32_t end = 0;
+        sendAll(socket, string((const char*)&end, sizeof(end)));
+        cout << "[*] File " << id << " download: " << formatThroughput(position - offset, chrono::steady_clock::now() - started) << endl;
+    }
+}
+
+// First command on a data connection instead of /login
+void handleTransferConnection(SOCKET socket, const string& command) {
+    stringstream ss(command);
+    string action, token;
+    uint64_t id = 0, offset = 0;
+    ss >> action >> id >> token >> offset;
+    setBulkPriority(socket);
+    setSocketTimeout(socket, TRANSFER_IDLE_MS, true);
+
+    // Data threads never park, so a hot upgrade must not wait for them
+    {
+        lock_guard<mutex> lock(handoffMutex);
+        --activeConnections;
+    }
+    handoffCv.notify_all();
+    if (action == "/upload") {
+        handleUpload(socket, id, token);
+    } else {
+        handleDownload(socket, id, token, offset);
+    }
+    ++activeConnections;   // serveClient's ConnectionGuard takes it back off
+}
+
+// Drops transfers that have been idle past their retention, with their files
+void transferExpiryLoop() {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(TRANSFER_SWEEP_SECONDS));
+        vector<uint64_t> expired;
+        {
+            lock_guard<mutex> lock(transfersMutex);
+            auto now = chrono::steady_clock::now();
+            for (auto it = transfers.begin(); it != transfers.end();) {
+                const FileTransfer& t = it->second;
+                auto keep = chrono::seconds(t.complete ? TRANSFER_KEEP_COMPLETE_SECONDS : TRANSFER_KEEP_PARTIAL_SECONDS);
+                if (!t.uploading && t.downloads == 0 && now - t.lastActivity >= keep) {
+                    expired.push_back(t.id);
+                    it = transfers.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (uint64_t id : expired) {
+            remove(spoolPath(id).c_str());
+            cout << "[*] File " << id << " expired" << endl;
+        }
+    }
+}
+
+bool isAdmin(const string& username) {
+    return find(config.admins.begin(), config.admins.end(), username) != config.admins.end();
+}
+
+string buildStats() {
+    static const char* penaltyNames[] = {"delay", "drop", "disconnect"};
+    stringstream ss;
+    ss << "\n[SYSTEM] === Server Stats ===\n"
+       << "[SYSTEM] Flood control (penalty: " << penaltyNames[config.floodPenalty] << ")\n"
+       << "[SYSTEM]   messages delayed:      " << floodDelayed << "\n"
+       << "[SYSTEM]   messages dropped:      " << floodDropped << "\n"
+       << "[SYSTEM]   clients disconnected:  " << floodDisconnected << "\n"
+       << "[SYSTEM]   auth attempts limited: " << authThrottled << "\n"
+       << "[SYSTEM] Search index\n"
+       << "[SYSTEM]   messages indexed:      " << indexedMessageCount() << "\n"
+       << "[SYSTEM]   messages not indexed:  " << indexDropped << " (indexer fell behind)\n";
+    if (config.traceSampleEvery > 0) {
+        ss << buildLatencyReport("[SYSTEM] ");
+    }
+    return ss.str();
+}
+
+// Serves one client connection. `resumed` is set for connections taken over
+// from a previous server process, whose greeting and join were already sent.
+void serveClient(SOCKET clientSocket, SessionState state, bool resumed) {
+    ConnectionGuard connectionGuard;
+    char buffer[4096];
+    string username = state.username;
+    string ipAddr = state.ipAddress;
+    bool authenticated = !username.empty();
+    SessionLimits limits(ipAddr);
+    
+    // Send authentication prompt
+    if (!resumed) {
+        sendToClient(clientSocket, "[SYSTEM] Welcome! Commands: /login username password OR /register username password");
+    }
+    
+    // Authentication loop
+    while (!authenticated) {
+        if (!waitReadable(clientSocket)) {
+            parkForHandoff(clientSocket, state);
+            continue;
+        }
+        memset(buffer, 0, sizeof(buffer));
+        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
+        if (bytesReceived <= 0) {
+            closeSocket(clientSocket);
+            return;
+        }
+        
+        string command(buffer);
+        stringstream ss(command);
+        string action, user, pass;
+        ss >> action >> user >> pass;
+        
+        // Data connections of a file transfer authenticate with its token
+        if (!resumed && (action == "/upload" || action == "/download")) {
+            handleTransferConnection(clientSocket, command);
+            closeSocket(clientSocket);
+            return;
+        }
+        
+        if (action == "/register" || action == "/login") {
+            FloodVerdict verdict = admitAuthAttempt(limits);
+            if (verdict == FLOOD_DISCONNECT) {
+                sendToClient(clientSocket, "[ERROR] Too many attempts, disconnecting");
+                closeSocket(clientSocket);
+                return;
+            }
+            if (verdict == FLOOD_DROP) {
+                sendToClient(clientSocket, "[ERROR] Too many attempts, try again later");
+                continue;
+            }
+        }
+        
+        if (action == "/register") {
+            if (user.empty() || pass.empty()) {
+                sendToClient(clientSocket, "[ERROR] Usage: /register username password");
+                continue;
+            }
+            
+            if (userExists(user)) {
+                sendToClient(clientSocket, "[ERROR] Username already exists!");
+                continue;
+            }
+            
+            string hashedPass = hashPassword(pass);
+            users[user] = {user, hashedPass};
+            saveUser(user, hashedPass);
+            relayToPeers("USER", user + " " + hashedPass);
+            sendToClient(clientSocket, "[SUCCESS] Registration successful! Now use /login username password");
+            cout << "[+] New user registered: " << user << endl;
+            
+        } else if (action == "/login") {
+            if (user.empty() || pass.empty()) {
+                sendToClient(clientSocket, "[ERROR] Usage: /login username password");
+                continue;
+            }
+            
+            if (!userExists(user)) {
+                sendToClient(clientSocket, "[ERROR] Username not found! Use /register first.");
+                continue;
+            }
+            
+            if (!verifyPassword(user, pass)) {
+                sendToClient(clientSocket, "[ERROR] Invalid password!");
+                continue;
+            }
+            
+            // Check if user already logged in
+            {
+                lock_guard<mutex> lock(clientsMutex);
+                bool alreadyLoggedIn = false;
+                for (const auto& client : clients) {
+                    if (client.username == user && client.authenticated) {
+                        alreadyLoggedIn = true;
+                        break;
+                    }
+                }
+                // Users on other nodes count as well; the relayed roster is
+                // eventually consistent, so this is best-effort across nodes
+                if (alreadyLoggedIn || isRemoteUser(user)) {
+                    sendToClient(clientSocket, "[ERROR] User already logged in!");
+                    continue;
+                }
+            }
+            
+            username = user;
+            state.username = user;
+            authenticated = true;
+            sendToClient(clientSocket, "[SUCCESS] Login successful! Welcome to the chat!");
+            
+        } else {
+            sendToClient(clientSocket, "[ERROR] Unknown command. Use /login or /register");
+        }
+    }
+    
+    if (!resumed) {
+        // Add authenticated client to list
+        {
+            lock_guard<mutex> lock(clientsMutex);
+            clients.push_back({clientSocket, username, ipAddr, true});
+            cout << "\n[+] " << username << " logged in from " << ipAddr << endl;
+            cout << "[*] Active users: " << clients.size() << endl;
+        }
+        
+        // Notify all clients, here and on the other nodes
+        announceJoin(username);
+        relayToPeers("JOIN", username);
+        
+        // Send welcome message
+        string welcome = "[SYSTEM] Type /help for commands";
+        sendToClient(clientSocket, welcome);
+    }
+    
+    // Main message loop
+    while (true) {
+        if (!waitReadable(clientSocket)) {
+            parkForHandoff(clientSocket, state);
+            continue;
+        }
+        memset(buffer, 0, sizeof(buffer));
+        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
+        
+        if (bytesReceived <= 0) {
+            break;
+        }
+        FloodVerdict verdict = admitMessage(limits, (size_t)bytesReceived);
+        if (verdict == FLOOD_DISCONNECT) {
+            sendToClient(clientSocket, "[ERROR] Flooding detected, disconnecting");
+            cout << "[!] Disconnected " << username << " for flooding" << endl;
+            break;
+        }
+        if (verdict == FLOOD_DROP) {
+            if (shouldNotify(limits)) {
+                sendToClient(clientSocket, "[ERROR] Slow down! Messages are being dropped");
+            }
+            continue;
+        }
+        MessageTrace trace;
+        startTrace(trace);
+        
+        string message(buffer);
+        
+        if (message == "/quit") {
+            break;
+        } else if (message == "/users" || message.compare(0, 7, "/users ") == 0) {
+            // "/users <version>" asks only for what changed since that version
+            stringstream ss(message.substr(6));
+            uint64_t sinceVersion = 0;
+            bool wantsDelta = (bool)(ss >> sinceVersion);
+            sendToClient(clientSocket, rosterReply(wantsDelta, sinceVersion));
+        } else if (message == "/help") {
+            string help = "\n[SYSTEM] === Commands ===\n";
+            help += "[SYSTEM] /users [version] - List all users, or changes since a version\n";
+            help += "[SYSTEM] /search terms [room] - Search message history\n";
+            help += "[SYSTEM] /send user|room file - Send a file\n";
+            help += "[SYSTEM] /fetch id - Download a file sent to you\n";
+            help += "[SYSTEM] /help - Show this help\n";
+            help += "[SYSTEM] /quit - Leave chat\n";
+            if (isAdmin(username)) {
+                help += "[SYSTEM] /stats - Server statistics (admin)\n";
+            }
+            sendToClient(clientSocket, help);
+        } else if (message.compare(0, 8, "/search ") == 0 || message == "/search") {
+            sendToClient(clientSocket, handleSearch(message.substr(min(message.size(), (size_t)8))));
+        } else if (message.compare(0, 6, "/send ") == 0) {
+            sendToClient(clientSocket, handleSendCommand(username, message.substr(6)));
+        } else if (message.compare(0, 7, "/fetch ") == 0) {
+            sendToClient(clientSocket, handleFetchCommand(username, message.substr(7)));
+        } else if (message == "/stats" && isAdmin(username)) {
+            sendToClient(clientSocket, buildStats());
+        } else {
+            string timestamp = getCurrentTime();
+            string fullMessage = "[" + timestamp + "] " + username + ": " + message;
+            if (trace.sampled) {
+                trace.parsed = chrono::steady_clock::now();
+                recordSpan(SPAN_READ_PARSE, trace.read, trace.parsed);
+            }
+            
+            // Store in history
+            state.lastSeq = storeHistory(state.room, fullMessage);
+            if (trace.sampled) {
+                trace.persisted = chrono::steady_clock::now();
+                recordSpan(SPAN_PARSE_PERSIST, trace.parsed, trace.persisted);
+            }
+            
+            // Broadcast to all authenticated clients, then to the other nodes
+            broadcastMessage(fullMessage, (SOCKET)-1, &trace);
+            relayToPeers("MSG", state.room + " " + fullMessage);
+            
+            // Log to server console
+            cout << fullMessage << endl;
+        }
+    }
+    
+    // Client disconnected
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        clients.erase(
+            remove_if(clients.begin(), clients.end(),
+                [clientSocket](const Client& c) { return c.socket == clientSocket; }),
+            clients.end()
+        );
+        cout << "\n[-] " << username << " left the chat" << endl;
+        cout << "[*] Active users: " << clients.size() << endl;
+    }
+    
+    announceLeave(username);
+    relayToPeers("LEAVE", username);
+    
+    closeSocket(clientSocket);
+}
+
+void handleClient(SOCKET clientSocket, sockaddr_in clientAddr) {
+    SessionState state = {inet_ntoa(clientAddr.sin_addr), "", DEFAULT_ROOM, 0};
+    serveClient(clientSocket, state, false);
+}
+
+#ifndef WINDOWS_BUILD
+// ---------------------------------------------------------------------------
+// Hot upgrade
+//
+// A server started with --upgrade-socket PATH listens on that Unix socket.
+// A newer binary started with the same PATH connects to it, and the old
+// process sends over SOCK_SEQPACKET, one record per packet:
+//   LISTEN                                   + listening socket(s) (SCM_RIGHTS)
+//   SESSION <ip> <user|-> <room> <lastSeq>   + the client's socket
+//   INDEX <path>                             search index saved to a file
+//   HISTORY <room> <message>
+//   SEQ <messageSeq>
+//   NODE <nodeId> <epoch> <lastSeq>          cluster dedupe state
+//   REMOTE <user> <nodeId>                   users on other nodes
+//   RELAY <host:port> <type> <payload>       records peers haven't received
+//   FILE <id> <token> <sender> <target> <isRoom> <size> <received> <complete> <name>
+//   FILEID <nextTransferId>
+//   PRESENCE <rosterVersion>
+//   END
+// The new process answers OK, after which the old one exits. Anything else,
+// including a counterpart that stalls for HANDOFF_IO_TIMEOUT_MS, aborts the
+// upgrade and the old process resumes serving. Only processes of the same
+// user may connect to the socket.
+// ---------------------------------------------------------------------------
+
+bool sendWithFds(int sock, const string& payload, const vector<int>& fds) {
+    iovec iov;
+    iov.iov_base = (void*)payload.data();
+    iov.iov_len = payload.size();
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    if (!fds.empty()) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    return sendmsg(sock, &msg, 0) == (ssize_t)payload.size();
+}
+
+bool recvWithFds(int sock, string& payload, vector<int>& fds) {
+    char buffer[65536];
+    iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer);
+
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sock, &msg, 0);
+    if (n <= 0) {
+        return false;
+    }
+    payload.assign(buffer, n);
+    fds.clear();
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* data = (const int*)CMSG_DATA(cmsg);
+            fds.insert(fds.end(), data, data + count);
+        }
+    }
+    return true;
+}
+
+// Index handoff file. Numbers are in native byte order: only a newer binary
+// on the same host reads it back.
+const uint64_t INDEX_FILE_VERSION = 1;
+const uint64_t INDEX_FILE_STRING_MAX = 1 << 20;
+
+void writeNumber(ostream& out, uint64_t value) {
+    out.write((const char*)&value, sizeof(value));
+}
+
+void writeString(ostream& out, const string& value) {
+    writeNumber(out, value.size());
+    out.write(value.data(), value.size());
+}
+
+bool readNumber(istream& in, uint64_t& value) {
+    return (bool)in.read((char*)&value, sizeof(value));
+}
+
+bool readString(istream& in, string& value) {
+    uint64_t length = 0;
+    if (!readNumber(in, length) || length > INDEX_FILE_STRING_MAX) return false;
+    value.resize((size_t)length);
+    return length == 0 || (bool)in.read(&value[0], (streamsize)length);
+}
+
+// Seals the active segment and writes every segment, plus the messages still
+// queued for the indexer, to an owner-only file at `path`
+bool saveIndex(const string& path) {
+    vector<shared_ptr<const IndexSegment>> segments;
+    deque<IndexedMessage> pending;
+    {
+        lock_guard<mutex> lock(indexMutex);
+        sealActiveSegment();
+        segments = sealedSegments;
+    }
+    {
+        lock_guard<mutex> lock(indexQueueMutex);
+        pending = indexQueue;
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return false;
+    ::close(fd);
+    ofstream out(path.c_str(), ios::binary | ios::trunc);
+    writeNumber(out, INDEX_FILE_VERSION);
+    writeNumber(out, segments.size());
+    for (const auto& segment : segments) {
+        writeNumber(out, (uint64_t)segment->firstTime);
+        writeNumber(out, (uint64_t)segment->lastTime);
+        writeNumber(out, segment->size());
+        for (size_t i = 0; i < segment->size(); i++) {
+            writeNumber(out, segment->seqs[i]);
+            writeNumber(out, segment->roomIds[i]);
+            writeString(out, segment->texts[i]);
+        }
+        writeNumber(out, segment->rooms.size());
+        for (const auto& room : segment->rooms) writeString(out, room);
+        writeNumber(out, segment->postings.size());
+        for (const auto& entry : segment->postings) {
+            writeString(out, entry.first);
+            writeString(out, entry.second);
+        }
+    }
+    writeNumber(out, pending.size());
+    for (const auto& doc : pending) {
+        writeNumber(out, doc.seq);
+        writeNumber(out, (uint64_t)doc.time);
+        writeString(out, doc.room);
+        writeString(out, doc.text);
+    }
+    out.close();
+    return !out.fail();
+}
+
+// Replaces the (still empty) index with one written by saveIndex
+bool loadIndex(const string& path) {
+    ifstream in(path.c_str(), ios::binary);
+    uint64_t version = 0, segmentCount = 0;
+    if (!readNumber(in, version) || version != INDEX_FILE_VERSION || !readNumber(in, segmentCount)) {
+        return false;
+    }
+
+    vector<shared_ptr<const IndexSegment>> segments;
+    for (uint64_t n = 0; n < segmentCount; n++) {
+        shared_ptr<IndexSegment> segment(new IndexSegment());
+        uint64_t firstTime = 0, lastTime = 0, docs = 0, rooms = 0, terms = 0;
+        if (!readNumber(in, firstTime) || !readNumber(in, lastTime) || !readNumber(in, docs)) return false;
+        segment->firstTime = (time_t)firstTime;
+        segment->lastTime = (time_t)lastTime;
+        for (uint64_t i = 0; i < docs; i++) {
+            uint64_t seq = 0, roomId = 0;
+            string text;
+            if (!readNumber(in, seq) || !readNumber(in, roomId) || !readString(in, text)) return false;
+            segment->seqs.push_back(seq);
+            segment->roomIds.push_back((uint32_t)roomId);
+            segment->texts.push_back(move(text));
+        }
+        if (!readNumber(in, rooms)) return false;
+        for (uint64_t i = 0; i < rooms; i++) {
+            string room;
+            if (!readString(in, room)) return false;
+            segment->rooms.push_back(move(room));
+        }
+        for (uint32_t roomId : segment->roomIds) {
+            if (roomId >= segment->rooms.size()) return false;
+        }
+        if (!readNumber(in, terms)) return false;
+        for (uint64_t i = 0; i < terms; i++) {
+            string term, encoded;
+            if (!readString(in, term) || !readString(in, encoded)) return false;
+            segment->postings[term] = move(encoded);
+        }
+        segments.push_back(segment);
+    }
+
+    uint64_t pendingCount = 0;
+    if (!readNumber(in, pendingCount)) return false;
+    deque<IndexedMessage> pending;
+    for (uint64_t n = 0; n < pendingCount; n++) {
+        IndexedMessage doc;
+        uint64_t docTime = 0;
+        if (!readNumber(in, doc.seq) || !readNumber(in, docTime) ||
+            !readString(in, doc.room) || !readString(in, doc.text)) {
+            return false;
+        }
+        doc.time = (time_t)docTime;
+        pending.push_back(move(doc));
+    }
+
+    {
+        lock_guard<mutex> lock(indexMutex);
+        sealedSegments = segments;
+    }
+    {
+        lock_guard<mutex> lock(indexQueueMutex);
+        indexQueue.insert(indexQueue.begin(), pending.begin(), pending.end());
+    }
+    indexQueueCv.notify_one();
+    return true;
+}
+
+string indexHandoffPath() {
+    return config.upgradeSocket + ".index";
+}
+
+bool sendHandoffState(int conn) {
+    vector<int> listeners(1, clientListener);
+    if (clusterListener != INVALID_SOCKET) {
+        listeners.push_back(clusterListener);
+    }
+    if (!sendWithFds(conn, "LISTEN", listeners)) {
+        return false;
+    }
+
+    {
+        lock_guard<mutex> lock(handoffMutex);
+        for (const auto& parked : parkedSessions) {
+            const SessionState& state = parked.second;
+            string record = "SESSION " + state.ipAddress + " " +
+                            (state.username.empty() ? "-" : state.username) + " " +
+                            state.room + " " + to_string(state.lastSeq);
+            if (!sendWithFds(conn, record, vector<int>(1, parked.first))) {
+                return false;
+            }
+        }
+    }
+
+    // Without it the new process re-indexes only the HISTORY below
+    string indexPath = indexHandoffPath();
+    if (saveIndex(indexPath) && !sendWithFds(conn, "INDEX " + indexPath, vector<int>())) {
+        return false;
+    }
+
+    {
+        lock_guard<mutex> lock(historyMutex);
+        for (const auto& room : messageHistory) {
+            for (const auto& message : room.second) {
+                if (!sendWithFds(conn, "HISTORY " + room.first + " " + message, vector<int>())) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    if (!sendWithFds(conn, "SEQ " + to_string(messageSeq.load()), vector<int>())) {
+        return false;
+    }
+
+    vector<string> records;
+    {
+        lock_guard<mutex> lock(remoteMutex);
+        for (const auto& node : remoteNodes) {
+            records.push_back("NODE " + node.first + " " + to_string(node.second.epoch) + " " +
+                              to_string(node.second.lastSeq));
+        }
+        for (const auto& user : remoteUsers) {
+            records.push_back("REMOTE " + user.first + " " + user.second);
+        }
+    }
+    for (const auto& relay : freezeRelays(HANDOFF_RELAY_FLUSH_MS)) {
+        records.push_back("RELAY " + relay.first + " " + relay.second.type + " " + relay.second.payload);
+    }
+    {
+        // Spool files stay where they are; running uploads resume from `received`
+        lock_guard<mutex> lock(transfersMutex);
+        for (const auto& entry : transfers) {
+            const FileTransfer& t = entry.second;
+            records.push_back("FILE " + to_string(t.id) + " " + t.token + " " + t.sender + " " + t.target + " " +
+                              (t.targetIsRoom ? "1 " : "0 ") + to_string(t.size) + " " + to_string(t.received) +
+                              (t.complete ? " 1 " : " 0 ") + t.name);
+        }
+        records.push_back("FILEID " + to_string(nextTransferId));
+    }
+    {
+        lock_guard<mutex> lock(rosterMutex);
+        records.push_back("PRESENCE " + to_string(rosterVersion));
+    }
+    for (const auto& record : records) {
+        if (!sendWithFds(conn, record, vector<int>())) {
+            return false;
+        }
+    }
+    return sendWithFds(conn, "END", vector<int>());
+}
+
+void abortHandoff() {
+    lock_guard<mutex> lock(handoffMutex);
+    char drain[64];
+    while (read(handoffPipe[0], drain, sizeof(drain)) > 0) {}
+    parkedSessions.clear();
+    handoffInProgress = false;
+    handoffCv.notify_all();
+    unfreezeRelays();
+    unlink(indexHandoffPath().c_str());
+}
+
+// Runs in the old process when a new binary connects to the upgrade socket
+bool performHandoff(int conn) {
+    setSocketTimeout(conn, HANDOFF_IO_TIMEOUT_MS, true);
+    {
+        lock_guard<mutex> lock(handoffMutex);
+        handoffInProgress = true;
+    }
+    char wake = 1;
+    if (write(handoffPipe[1], &wake, 1) != 1) {
+        abortHandoff();
+        return false;
+    }
+
+    {
+        unique_lock<mutex> lock(handoffMutex);
+        bool allParked = handoffCv.wait_for(lock, chrono::seconds(HANDOFF_PARK_SECONDS),
+            [] { return (int)parkedSessions.size() >= activeConnections; });
+        if (!allParked) {
+            cerr << "[!] " << activeConnections - (int)parkedSessions.size()
+                 << " connection(s) did not park in time and will be dropped" << endl;
+        }
+    }
+
+    string reply;
+    vector<int> fds;
+    if (!sendHandoffState(conn) || !recvWithFds(conn, reply, fds) || reply != "OK") {
+        cerr << "[!] Hot upgrade aborted, resuming service" << endl;
+        abortHandoff();
+        return false;
+    }
+    cout << "[*] Handed " << parkedSessions.size() << " connection(s) to the new server, exiting" << endl;
+    return true;
+}
+
+// Whether the process on the other end of `conn` runs as our user
+bool peerIsSameUser(int conn) {
+#ifdef SO_PEERCRED
+    ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) {
+        return false;
+    }
+    uid_t uid = cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(conn, &uid, &gid) != 0) {
+        return false;
+    }
+#endif
+    return uid == geteuid();
+}
+
+void upgradeListenLoop(int listener) {
+    while (true) {
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn < 0) {
+            continue;
+        }
+        if (!peerIsSameUser(conn)) {
+            cerr << "[!] Rejected hot upgrade request from another user" << endl;
+            ::close(conn);
+            continue;
+        }
+        bool handedOff = performHandoff(conn);
+        ::close(conn);
+        if (handedOff) {
+            cout.flush();
+            // Parked threads still hold locks and sockets; skip destructors
+            _exit(0);
+        }
+    }
+}
+
+bool startUpgradeListener(const string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "Upgrade socket path too long: " << path << endl;
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    if (pipe(handoffPipe) != 0) {
+        cerr << "Error creating handoff pipe!" << endl;
+        return false;
+    }
+    fcntl(handoffPipe[0], F_SETFL, O_NONBLOCK);
+
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    unlink(path.c_str());
+    // Owner-only from the moment it exists; whoever connects gets our sockets
+    mode_t oldMask = umask(0077);
+    bool bound = listener >= 0 && ::bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(oldMask);
+    if (!bound || chmod(path.c_str(), 0600) != 0 || listen(listener, 1) != 0) {
+        cerr << "Error listening on upgrade socket " << path << "!" << endl;
+        return false;
+    }
+    thread(upgradeListenLoop, listener).detach();
+    cout << "[*] Hot upgrade socket: " << path << endl;
+    return true;
+}
+
+enum TakeoverResult { TAKEOVER_NONE, TAKEOVER_DONE, TAKEOVER_FAILED };
+
+// Runs in the new process: adopts the listeners, sessions and history of a
+// server already running on `path`, if there is one
+TakeoverResult takeOver(const string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return TAKEOVER_NONE;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (conn < 0 || connect(conn, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (conn >= 0) ::close(conn);
+        return TAKEOVER_NONE;
+    }
+    if (!peerIsSameUser(conn)) {
+        cerr << "Upgrade socket " << path << " belongs to another user" << endl;
+        ::close(conn);
+        return TAKEOVER_FAILED;
+    }
+    // The old server first waits for its sessions to park and its peer links to drain
+    setSocketTimeout(conn, HANDOFF_PARK_SECONDS * 1000 + HANDOFF_RELAY_FLUSH_MS + HANDOFF_IO_TIMEOUT_MS, true);
+    cout << "[*] Taking over from the running server..." << endl;
+
+    vector<pair<SOCKET, SessionState>> sessions;
+    vector<int> listeners;
+    map<string, RemoteNode> nodes;
+    map<string, string> otherUsers;
+    uint64_t previousRosterVersion = 0;
+    bool indexAdopted = false;
+    PendingRelays relays;
+    string record;
+    vector<int> fds;
+    bool complete = false;
+
+    while (recvWithFds(conn, record, fds)) {
+        stringstream ss(record);
+        string type;
+        ss >> type;
+        if (type == "LISTEN") {
+            listeners = fds;
+        } else if (type == "SESSION" && fds.size() == 1) {
+            SessionState state;
+            ss >> state.ipAddress >> state.username >> state.room >> state.lastSeq;
+            if (state.username == "-") state.username.clear();
+            sessions.push_back(make_pair(fds[0], state));
+        } else if (type == "INDEX") {
+            string indexPath;
+            ss >> indexPath;
+            indexAdopted = loadIndex(indexPath);
+            unlink(indexPath.c_str());
+        } else if (type == "HISTORY") {
+            string room, message;
+            ss >> room;
+            getline(ss, message);
+            // Renumbered by SEQ below
+            if (!message.empty()) storeHistory(room, message.substr(1), !indexAdopted);
+        } else if (type == "SEQ") {
+            uint64_t seq = 0;
+            ss >> seq;
+            messageSeq = seq;
+        } else if (type == "NODE") {
+            string nodeId;
+            RemoteNode node = RemoteNode();
+            ss >> nodeId >> node.epoch >> node.lastSeq;
+            // Down until the peer reconnects, so its users expire if it never does
+            node.downSince = chrono::steady_clock::now();
+            nodes[nodeId] = node;
+        } else if (type == "REMOTE") {
+            string user, nodeId;
+            ss >> user >> nodeId;
+            otherUsers[user] = nodeId;
+        } else if (type == "RELAY") {
+            string address;
+            RelayRecord relay;
+            ss >> address >> relay.type;
+            getline(ss, relay.payload);
+            if (!relay.payload.empty()) relay.payload.erase(0, 1);
+            relays.push_back(make_pair(address, relay));
+        } else if (type == "FILE") {
+            FileTransfer t = FileTransfer();
+            ss >> t.id >> t.token >> t.sender >> t.target >> t.targetIsRoom >> t.size >> t.received
+               >> t.complete >> t.name;
+            t.lastActivity = chrono::steady_clock::now();
+            lock_guard<mutex> lock(transfersMutex);
+            transfers[t.id] = t;
+        } else if (type == "PRESENCE") {
+            ss >> previousRosterVersion;
+        } else if (type == "FILEID") {
+            lock_guard<mutex> lock(transfersMutex);
+            ss >> nextTransferId;
+        } else if (type == "END") {
+            complete = true;
+            break;
+        }
+    }
+
+    if (!complete || listeners.empty() || !sendWithFds(conn, "OK", vector<int>())) {
+        cerr << "Hot upgrade failed, the old server keeps running" << endl;
+        for (int fd : listeners) ::close(fd);
+        for (const auto& session : sessions) ::close(session.first);
+        ::close(conn);
+        return TAKEOVER_FAILED;
+    }
+    ::close(conn);
+
+    clientListener = listeners[0];
+    if (listeners.size() > 1) {
+        clusterListener = listeners[1];
+    }
+    map<string, string> present = otherUsers;
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        for (const auto& session : sessions) {
+            if (!session.second.username.empty()) {
+                clients.push_back({session.first, session.second.username, session.second.ipAddress, true});
+                present[session.second.username] = "";
+            }
+        }
+    }
+    {
+        // Known up front, so the peers' ROSTER on reconnect doesn't re-announce them
+        lock_guard<mutex> lock(remoteMutex);
+        remoteNodes = nodes;
+        remoteUsers = otherUsers;
+    }
+    seedRoster(present, previousRosterVersion);
+    adoptedRelays = relays;
+    for (const auto& session : sessions) {
+        ++activeConnections;
+        thread(serveClient, session.first, session.second, true).detach();
+    }
+    cout << "[*] Took over " << sessions.size() << " connection(s)" << endl;
+    return TAKEOVER_DONE;
+}
+#endif
+
+// Creates a socket listening on `address` (all interfaces if empty), or
+// INVALID_SOCKET on error
+SOCKET createListener(int port, const string& address = "") {
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET) {
+        cerr << "Error creating socket!" << endl;
+        return INVALID_SOCKET;
+    }
+    
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+    
+    sockaddr_in serverAddress;
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+    if (!address.empty() && inet_pton(AF_INET, address.c_str(), &serverAddress.sin_addr) != 1) {
+        cerr << "Invalid listen address: " << address << endl;
+        closeSocket(listener);
+        return INVALID_SOCKET;
+    }
+    
+    if (::bind(listener, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == SOCKET_ERROR) {
+        cerr << "Error binding socket on port " << port << "!" << endl;
+        closeSocket(listener);
+        return INVALID_SOCKET;
+    }
+    if (listen(listener, 10) == SOCKET_ERROR) {
+        cerr << "Error listening on socket!" << endl;
+        closeSocket(listener);
+        return INVALID_SOCKET;
+    }
+    return listener;
+}
+
+void printUsage(const char* program) {
+    cout << "Usage: " << program << " [options]\n"
+         << "  --port N            Client port (default 8080)\n"
+         << "  --node-id NAME      Name of this node in a cluster (default node-<port>)\n"
+         << "  --cluster-port N    Port for inter-node links (enables clustering)\n"
+         << "  --cluster-bind ADDR Address the cluster port listens on (default 127.0.0.1)\n"
+         << "  --cluster-secret S  Secret every node of the cluster must share\n"
+         << "  --peer HOST:PORT    Cluster port of another node (repeatable)\n"
+         << "  --upgrade-socket P  Unix socket for zero-downtime upgrades; a new server\n"
+         << "                      started with the same path takes over this one\n"
+         << "  --admin USER        Allow USER to run admin commands (repeatable)\n"
+         << "  --msg-rate N        Messages per second per session (default 10)\n"
+         << "  --byte-rate N       Bytes per second per session (default 32768)\n"
+         << "  --ip-msg-rate N     Messages per second per IP (default 40)\n"
+         << "  --ip-byte-rate N    Bytes per second per IP (default 131072)\n"
+         << "  --auth-rate N       Login/register attempts per second per IP (default 0.2)\n"
+         << "  --flood-penalty P   delay, drop or disconnect (default drop)\n"
+         << "                      Rates of 0 disable the limit\n"
+         << "  --search-max-docs N Messages kept in the search index (default 1000000)\n"
+         << "  --spool-dir DIR     Directory for transferred files (default spool)\n"
+         << "  --spool-max-mb N    Total size of transferred files kept (default 1024)\n"
+         << "  --trace-sample N    Trace latency of one in N messages (default 100, 0 = off)\n"
+         << "  --trace-dump FILE   Rewrite FILE with latency histograms every 10 seconds\n";
+}
+
+bool parseArgs(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--port" && hasValue) {
+            config.port = atoi(argv[++i]);
+        } else if (arg == "--node-id" && hasValue) {
+            config.nodeId = argv[++i];
+        } else if (arg == "--cluster-port" && hasValue) {
+            config.clusterPort = atoi(argv[++i]);
+        } else if (arg == "--cluster-bind" && hasValue) {
+            config.clusterBind = argv[++i];
+        } else if (arg == "--cluster-secret" && hasValue) {
+            config.clusterSecret = argv[++i];
+        } else if (arg == "--peer" && hasValue) {
+            config.peers.push_back(argv[++i]);
+        } else if (arg == "--upgrade-socket" && hasValue) {
+            config.upgradeSocket = argv[++i];
+        } else if (arg == "--admin" && hasValue) {
+            config.admins.push_back(argv[++i]);
+        } else if (arg == "--msg-rate" && hasValue) {
+            config.sessionMessageRate = atof(argv[++i]);
+        } else if (arg == "--byte-rate" && hasValue) {
+            config.sessionByteRate = atof(argv[++i]);
+        } else if (arg == "--ip-msg-rate" && hasValue) {
+            config.ipMessageRate = atof(argv[++i]);
+        } else if (arg == "--ip-byte-rate" && hasValue) {
+            config.ipByteRate = atof(argv[++i]);
+        } else if (arg == "--auth-rate" && hasValue) {
+            config.authRate = atof(argv[++i]);
+        } else if (arg == "--trace-sample" && hasValue) {
+            config.traceSampleEvery = (uint32_t)atol(argv[++i]);
+        } else if (arg == "--trace-dump" && hasValue) {
+            config.traceDumpFile = argv[++i];
+        } else if (arg == "--spool-dir" && hasValue) {
+            config.spoolDir = argv[++i];
+        } else if (arg == "--spool-max-mb" && hasValue) {
+            config.spoolMaxBytes = (uint64_t)atol(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--search-max-docs" && hasValue) {
+            config.searchMaxDocs = (size_t)atol(argv[++i]);
+        } else if (arg == "--flood-penalty" && hasValue) {
+            string penalty = argv[++i];
+            if (penalty == "delay") config.floodPenalty = PENALTY_DELAY;
+            else if (penalty == "drop") config.floodPenalty = PENALTY_DROP;
+            else if (penalty == "disconnect") config.floodPenalty = PENALTY_DISCONNECT;
+            else {
+                cerr << "Unknown flood penalty: " << penalty << endl;
+                return false;
+            }
+        } else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    configureFloodControl();
+    if (config.nodeId.empty()) {
+        config.nodeId = "node-" + to_string(config.port);
+    }
+    if (!config.peers.empty() && !clusterEnabled()) {
+        cerr << "--peer requires --cluster-port" << endl;
+        return false;
+    }
+    if (config.clusterSecret.find_first_of(" \t\r\n") != string::npos) {
+        cerr << "--cluster-secret must not contain whitespace" << endl;
+        return false;
+    }
+#ifdef WINDOWS_BUILD
+    if (!config.upgradeSocket.empty()) {
+        cerr << "--upgrade-socket is not supported on Windows" << endl;
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool startCluster() {
+    if (clusterListener == INVALID_SOCKET) {
+        clusterListener = createListener(config.clusterPort, config.clusterBind);
+    }
+    if (clusterListener == INVALID_SOCKET) {
+        return false;
+    }
+    if (config.clusterSecret.empty() && config.clusterBind != "127.0.0.1") {
+        cerr << "[!] Cluster port is reachable from other hosts without --cluster-secret" << endl;
+    }
+    nodeEpoch = (uint64_t)chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+
+    for (const auto& peer : config.peers) {
+        size_t colon = peer.rfind(':');
+        if (colon == string::npos) {
+            cerr << "Invalid peer address: " << peer << endl;
+            continue;
+        }
+        unique_ptr<PeerLink> link(new PeerLink());
+        link->host = peer.substr(0, colon);
+        link->port = atoi(peer.substr(colon + 1).c_str());
+        link->nextSeq = 1;
+        link->sending = false;
+        link->broken = false;
+        link->frozen = false;
+        string address = link->host + ":" + to_string(link->port);
+        for (auto& relay : adoptedRelays) {
+            if (relay.first == address) link->queue.push_back(relay.second);
+        }
+        peerLinks.push_back(move(link));
+    }
+    adoptedRelays.clear();
+    for (auto& link : peerLinks) {
+        thread(peerSenderLoop, link.get()).detach();
+    }
+    thread(clusterListenLoop, clusterListener).detach();
+    thread(clusterMaintenanceLoop).detach();
+
+    cout << "[*] Cluster node " << config.nodeId << " listening on port "
+         << config.clusterPort << " with " << peerLinks.size() << " peer(s)" << endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArgs(argc, argv)) {
+        return 1;
+    }
+
+    cout << "+========================================+\n";
+    cout << "|   C++ Messenger Server v2.0            |\n";
+    cout << "|   With User Authentication             |\n";
+#ifdef WINDOWS_BUILD
+    cout << "|        Windows Build                   |\n";
+#else
+    cout << "|        Linux/Unix Build                |\n";
+#endif
+    cout << "+========================================+\n\n";
+    
+    // Load existing users
+    loadUsers();
+    thread(indexerLoop).detach();
+    thread(presenceLoop).detach();
+#ifdef WINDOWS_BUILD
+    _mkdir(config.spoolDir.c_str());
+#else
+    mkdir(config.spoolDir.c_str(), 0700);
+#endif
+    thread(transferExpiryLoop).detach();
+    if (!config.traceDumpFile.empty() && config.traceSampleEvery > 0) {
+        thread(traceDumpLoop).detach();
+    }
+    
+#ifdef WINDOWS_BUILD
+    if (!initWinsock()) {
+        return 1;
+    }
+#else
+    // A peer or client vanishing mid-send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    
+#ifndef WINDOWS_BUILD
+    if (!config.upgradeSocket.empty() && takeOver(config.upgradeSocket) == TAKEOVER_FAILED) {
+        return 1;
+    }
+#endif
+    
+    if (clientListener == INVALID_SOCKET) {
+        clientListener = createListener(config.port);
+    }
+    SOCKET serverSocket = clientListener;
+    if (serverSocket == INVALID_SOCKET) {
+#ifdef WINDOWS_BUILD
+        cleanupWinsock();
+#endif
+        return 1;
+    }
+    
+    if (clusterEnabled() && !startCluster()) {
+        closeSocket(serverSocket);
+#ifdef WINDOWS_BUILD
+        cleanupWinsock();
+#endif
+        return 1;
+    }
+    
+#ifndef WINDOWS_BUILD
+    if (!config.upgradeSocket.empty() && !startUpgradeListener(config.upgradeSocket)) {
+        closeSocket(serverSocket);
+        return 1;
+    }
+#endif
+    
+    cout << "[*] Server started on port " << config.port << endl;
+    cout << "[*] Waiting for connections...\n" << endl;
+    
+    while (true) {
+        if (!waitReadable(serverSocket)) {
+            waitForHandoffEnd();
+            continue;
+        }
         sockaddr_in clientAddr;
         socklen_t clientAddrLen = sizeof(clientAddr);
 
@@ -383,6 +3296,7 @@ if (::bind(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)
             continue;
         }
 
+        ++activeConnections;
         thread clientThread(handleClient, clientSocket, clientAddr);
         clientThread.detach();
     }